@@ -1,128 +1,135 @@
 #include <GL/gl3w.h>
 #include <SDL.h>
-#include "vdp.h"
+#include <stdlib.h>
+#include <string.h>
+#include "glvdp.h"
 #include "../../include/vdp.h"
 
-void run_gl_vdp(vdp_context *vdp) {
-	static SDL_Window *window = NULL;
-	static SDL_GLContext *context = NULL;
-	if (!window) {
-		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
-		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 5);
-		SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+enum {
+	VRAM_SLOT_SIZE = 32, // a pattern, a quarter of a 64 cell name table row or four sprites
+	VRAM_SLOT_COUNT = VDP_VRAM_SIZE / VRAM_SLOT_SIZE,
+};
 
-		window = SDL_CreateWindow("GL VDP", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 640, 448, SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN);
-		context = SDL_GL_CreateContext(window);
-		SDL_GL_MakeCurrent(window, context);
-		gl3wInit();
-	}
-	SDL_GL_MakeCurrent(window, context);
+static SDL_Window *window = NULL;
+static SDL_GLContext *context = NULL;
+static vdp_queue_t *queue = NULL;
 
-	static vdp_context_t *glvdp = NULL;
-	if (!glvdp) {
-		glvdp = vdp_create_context();
-	}
-	glClearColor(1.0, 0.0, 0.0, 0.0);
-	glClear(GL_COLOR_BUFFER_BIT);
-	vdp_color_t colors[64];
-	for (size_t i = 0; i < 64; ++i) {
-		uint8_t r = vdp->cram[i] >> 1 & 7;
-		uint8_t g = vdp->cram[i] >> 5 & 7;
-		uint8_t b = vdp->cram[i] >> 9 & 7;
-		colors[i].r = r << 5 | r << 2 | r >> 1;
-		colors[i].g = g << 5 | g << 2 | g >> 1;
-		colors[i].b = b << 5 | b << 2 | b >> 1;
-	}
-	unsigned int hsize, vsize;
-	switch (vdp->regs[REG_SCROLL] & 3) {
-	case 0:
-		hsize = 32;
-		break;
-	case 1:
-		hsize = 64;
-		break;
-	default:
-		hsize = 128;
-		break;
-	}
-	switch ((vdp->regs[REG_SCROLL] >> 4) & 3) {
-	case 0:
-		vsize = 32;
-		break;
-	case 1:
-		vsize = 64;
-		break;
-	default:
-		vsize = 128;
-		break;
-	}
-	size_t plane_a = (vdp->regs[REG_SCROLL_A] & 0x38) << 10;
-	size_t plane_b = (vdp->regs[REG_SCROLL_B] & 0x7) << 13;
-	size_t plane_w = (vdp->regs[REG_WINDOW] & 0x3C) << 10;
-	size_t hscroll_addr = (vdp->regs[REG_HSCROLL] & 0x3F) << 10;
-	size_t sprite_addr = (vdp->regs[REG_SAT] & 0x7E) << 9;
-	int window_h = (vdp->regs[REG_WINDOW_H] & 0x1F) * ((vdp->regs[REG_WINDOW_H] & 0x80) ? -16 : 16);
-	int window_v = (vdp->regs[REG_WINDOW_V] & 0x1F) * ((vdp->regs[REG_WINDOW_V] & 0x80) ? -8 : 8);
+static uint64_t vram_dirty[VRAM_SLOT_COUNT / 64];
+static uint64_t cram_dirty = 0;
+static uint64_t vsram_dirty = 0;
+
+void glvdp_mark_vram(uint32_t address) {
+	const uint32_t slot = (address & (VDP_VRAM_SIZE - 1)) / VRAM_SLOT_SIZE;
+	vram_dirty[slot / 64] |= 1ull << slot % 64;
+}
 
-	uint8_t vdpmem[128 * 1024];
-	for (size_t i = 0; i < 64 * 1024; ++i) {
-		vdpmem[i] = vdp->vdpmem[i ^ 1];
+void glvdp_mark_cram(uint32_t index) {
+	cram_dirty |= 1ull << (index & (VDP_CRAM_COUNT - 1));
+}
+
+void glvdp_mark_vsram(uint32_t index) {
+	if (index < VDP_VSRAM_COUNT) {
+		vsram_dirty |= 1ull << index;
 	}
+}
 
-	uint16_t hscroll[2][VDP_HSCROLL_COUNT];
-	uint16_t *hs = (uint16_t *)&vdpmem[hscroll_addr];
-	switch (vdp->regs[REG_MODE_3] & 3) {
-	case 0:
-		for (size_t i = 0; i < VDP_HSCROLL_COUNT; ++i) {
-			hscroll[VDP_PLANE_A][i] = hs[0];
-			hscroll[VDP_PLANE_B][i] = hs[1];
-		}
-		break;
+void glvdp_mark_all() {
+	memset(vram_dirty, 0xFF, sizeof (vram_dirty));
+	cram_dirty = ~0ull;
+	vsram_dirty = (1ull << VDP_VSRAM_COUNT) - 1;
+}
 
-	case 2:
-		for (size_t i = 0; i < VDP_HSCROLL_COUNT; ++i) {
-			hscroll[VDP_PLANE_A][i] = hs[(i & ~7) * 2 + 0];
-			hscroll[VDP_PLANE_B][i] = hs[(i & ~7) * 2 + 1];
+static void upload_vram(vdp_context_t *glvdp, const uint8_t *vram) {
+	unsigned int first = VRAM_SLOT_COUNT;
+	for (unsigned int i = 0; i <= VRAM_SLOT_COUNT; ++i) {
+		if (i < VRAM_SLOT_COUNT && (vram_dirty[i / 64] >> i % 64 & 1)) {
+			first = first == VRAM_SLOT_COUNT ? i : first;
+		} else if (first < i) {
+			vdp_set_vram(glvdp, first * VRAM_SLOT_SIZE, (i - first) * VRAM_SLOT_SIZE, &vram[first * VRAM_SLOT_SIZE]);
+			first = VRAM_SLOT_COUNT;
 		}
-		break;
+	}
+	memset(vram_dirty, 0, sizeof (vram_dirty));
+}
 
-	default:
-		for (size_t i = 0; i < VDP_HSCROLL_COUNT; ++i) {
-			hscroll[VDP_PLANE_A][i] = hs[i * 2 + 0];
-			hscroll[VDP_PLANE_B][i] = hs[i * 2 + 1];
+static void upload_words(vdp_context_t *glvdp, uint64_t *dirty, unsigned int count, const uint16_t *data, void (*set)(vdp_context_t *, unsigned int, unsigned int, const uint16_t *)) {
+	unsigned int first = count;
+	for (unsigned int i = 0; i <= count; ++i) {
+		if (i < count && (*dirty >> i & 1)) {
+			first = first == count ? i : first;
+		} else if (first < i) {
+			set(glvdp, first, i - first, &data[first]);
+			first = count;
 		}
-		break;
 	}
+	*dirty = 0;
+}
 
-	uint16_t vscroll[2][VDP_VSCROLL_COUNT];
-	if (vdp->regs[REG_MODE_3] & 4) {
-		for (size_t i = 0; i < 20; ++i) {
-			vscroll[VDP_PLANE_A][i] = vdp->vsram[i * 2 + 0];
-			vscroll[VDP_PLANE_B][i] = vdp->vsram[i * 2 + 1];
-		}
-	} else {
-		for (size_t i = 0; i < 20; ++i) {
-			vscroll[VDP_PLANE_A][i] = vdp->vsram[0];
-			vscroll[VDP_PLANE_B][i] = vdp->vsram[1];
+// GLVDP_THREADED: the window's GL context belongs to this thread, the emulator only records calls
+static int render_thread(void *data) {
+	SDL_GL_MakeCurrent(window, context);
+	vdp_context_t *glvdp = vdp_create_context();
+	for (;;) {
+		if (!vdp_run_queue(queue, glvdp)) {
+			SDL_Delay(1);
+			continue;
 		}
+		glClearColor(1.0, 0.0, 0.0, 0.0);
+		glClear(GL_COLOR_BUFFER_BIT);
+		vdp_blit(glvdp, 0, 0, 640, 448, VDP_FILTER_NEAREST);
+		SDL_GL_SwapWindow(window);
+	}
+	return 0;
+}
+
+void run_gl_vdp(vdp_context *vdp) {
+	static vdp_headless_t *headless = NULL;
+	if (!window && !headless && getenv("GLVDP_HEADLESS")) {
+		headless = vdp_create_headless();
 	}
+	if (headless) {
+		vdp_bind_headless(headless);
+	} else if (!window) {
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 5);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
 
-	vdp_set_mode(glvdp, (vdp->regs[REG_MODE_4] & BIT_HILIGHT) ? VDP_MODE_INTENSITY : VDP_MODE_NORMAL);
-	vdp_set_background_color(glvdp, vdp->regs[REG_BG_COLOR]);
-	vdp_set_plane_size(glvdp, hsize, vsize);
-	vdp_set_window_coord(glvdp, window_h, window_v);
-	vdp_set_colors_sh(glvdp, 0, 64, colors);
-	vdp_set_patterns(glvdp, 0, VDP_PATTERN_COUNT, (uint32_t *)&vdp->vdpmem[0]);
+		window = SDL_CreateWindow("GL VDP", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 640, 448, SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN);
+		context = SDL_GL_CreateContext(window);
+		SDL_GL_MakeCurrent(window, context);
+		gl3wInit();
+		if (getenv("GLVDP_THREADED")) {
+			queue = vdp_create_queue(0);
+			SDL_GL_MakeCurrent(window, NULL);
+			SDL_CreateThread(render_thread, "glvdp", NULL);
+		}
+	}
+	if (window && !queue) {
+		SDL_GL_MakeCurrent(window, context);
+		glClearColor(1.0, 0.0, 0.0, 0.0);
+		glClear(GL_COLOR_BUFFER_BIT);
+	}
 
-	vdp_set_sprites(glvdp, 0, VDP_SPRITE_COUNT, (vdp_sprite_t *)&vdpmem[sprite_addr]);
-	vdp_set_cells(glvdp, VDP_PLANE_A, 0, 0, hsize, vsize, (vdp_cell_t *)&vdpmem[plane_a]);
-	vdp_set_cells(glvdp, VDP_PLANE_B, 0, 0, hsize, vsize, (vdp_cell_t *)&vdpmem[plane_b]);
-	vdp_set_cells(glvdp, VDP_PLANE_W, 0, 0, hsize, vsize, (vdp_cell_t *)&vdpmem[plane_w]);
-	vdp_set_hscroll(glvdp, VDP_PLANE_A, 0, VDP_HSCROLL_COUNT, hscroll[VDP_PLANE_A]);
-	vdp_set_vscroll(glvdp, VDP_PLANE_A, 0, VDP_VSCROLL_COUNT, vscroll[VDP_PLANE_A]);
-	vdp_set_hscroll(glvdp, VDP_PLANE_B, 0, VDP_HSCROLL_COUNT, hscroll[VDP_PLANE_B]);
-	vdp_set_vscroll(glvdp, VDP_PLANE_B, 0, VDP_VSCROLL_COUNT, vscroll[VDP_PLANE_B]);
+	static vdp_context_t *glvdp = NULL;
+	if (!glvdp) {
+		glvdp = queue ? vdp_create_queue_context(queue) : vdp_create_context();
+		glvdp_mark_all();
+	}
+	// only what the hooks in vdp.c saw written since the last frame, registers are too small to bother
+	vdp_begin_update(glvdp);
+	vdp_set_registers(glvdp, 0, VDP_REGISTER_COUNT, vdp->regs);
+	upload_vram(glvdp, vdp->vdpmem);
+	upload_words(glvdp, &cram_dirty, VDP_CRAM_COUNT, vdp->cram, vdp_set_cram);
+	upload_words(glvdp, &vsram_dirty, VDP_VSRAM_COUNT, vdp->vsram, vdp_set_vsram);
+	vdp_commit_update(glvdp);
 	vdp_render(glvdp);
+	if (headless) {
+		vdp_unbind_headless(headless);
+		return;
+	}
+	if (queue) {
+		return;
+	}
 	vdp_blit(glvdp, 0, 0, 640, 448, VDP_FILTER_NEAREST);
 	SDL_GL_SwapWindow(window);
 	SDL_GL_MakeCurrent(NULL, NULL);
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+#include "vdp.h"
+
+void run_gl_vdp(vdp_context *vdp);
+
+// Write hooks called by the patched vdp.c, each frame only uploads what they marked since the last one.
+void glvdp_mark_vram(uint32_t address);
+void glvdp_mark_cram(uint32_t index);
+void glvdp_mark_vsram(uint32_t index);
+void glvdp_mark_all();
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
 #include <vdp.h>
 
 static const unsigned char chakanfg[] = {
@@ -86,33 +87,63 @@ static void extract_patterns_from_png(uint32_t **patterns, vdp_color_t **colors,
 	free(pixels);
 }
 
+static double get_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
 static void APIENTRY display_debug_message(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar *message, const void *user) {
 	fprintf(stderr, "%s\n", message);
 }
 
-int main() {
-	glfwInit();
-
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-	glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GLFW_TRUE);
-	GLFWwindow* window = glfwCreateWindow(VDP_FRAMEBUFFER_WIDTH * 2, VDP_FRAMEBUFFER_HEIGHT * 2, "VDP demo", NULL, NULL);
-	if (!window) {
-		fprintf(stderr, "Unable to create GL window, exiting.\n");
-		return -1;
+int main(int argc, char *argv[]) {
+	bool headless = false;
+	unsigned int frames = 0;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--headless")) {
+			headless = true;
+		} else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+			frames = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
 	}
-	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_HIDDEN);
-	glfwMakeContextCurrent(window);
-	glfwSwapInterval(0);
 
-	if (gl3wInit()) {
-		glfwDestroyWindow(window);
-		fprintf(stderr, "Failed to initialize OpenGL, exiting.\n");
-		return -1;
+	GLFWwindow* window = NULL;
+	vdp_headless_t *headless_context = NULL;
+	if (headless) {
+		headless_context = vdp_create_headless();
+		if (!headless_context) {
+			fprintf(stderr, "Unable to create headless GL context, exiting.\n");
+			return -1;
+		}
+		if (!frames) {
+			frames = 600;
+		}
+	} else {
+		glfwInit();
+
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+		glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GLFW_TRUE);
+		window = glfwCreateWindow(VDP_FRAMEBUFFER_WIDTH * 2, VDP_FRAMEBUFFER_HEIGHT * 2, "VDP demo", NULL, NULL);
+		if (!window) {
+			fprintf(stderr, "Unable to create GL window, exiting.\n");
+			return -1;
+		}
+		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_HIDDEN);
+		glfwMakeContextCurrent(window);
+		glfwSwapInterval(0);
+
+		if (gl3wInit()) {
+			glfwDestroyWindow(window);
+			fprintf(stderr, "Failed to initialize OpenGL, exiting.\n");
+			return -1;
+		}
 	}
 	if (!gl3wIsSupported(4, 5)) {
 		glfwDestroyWindow(window);
+		vdp_destroy_headless(headless_context);
 		fprintf(stderr, "OpenGL 4.5 not supported, exiting.\n");
 		return -1;
 	}
@@ -122,6 +153,7 @@ int main() {
 	vdp_context_t *vdp = vdp_create_context();
 	if (!vdp) {
 		glfwDestroyWindow(window);
+		vdp_destroy_headless(headless_context);
 		fprintf(stderr, "Unable to create VDP emulator, exiting.\n");
 		return -1;
 	}
@@ -175,12 +207,13 @@ int main() {
 	vdp_set_hscroll(vdp, VDP_PLANE_B, 0, VDP_HSCROLL_COUNT, &hscroll_table[VDP_PLANE_B][0]);
 	vdp_set_vscroll(vdp, VDP_PLANE_B, 0, VDP_VSCROLL_COUNT, &vscroll_table[VDP_PLANE_B][0]);
 
-	double last_t = glfwGetTime();
+	double start_t = get_time();
+	double last_t = start_t;
 	unsigned int frame_count = 0;
-	while (!glfwWindowShouldClose(window)) {
-		double t = glfwGetTime();
+	for (unsigned int frame = 0; frames ? frame < frames : !glfwWindowShouldClose(window); ++frame) {
+		double t = headless ? frame / 60.0 : get_time() - start_t;
 		++frame_count;
-		if (t - last_t >= 1.0) {
+		if (!headless && t - last_t >= 1.0) {
 			char title[128];
 			snprintf(title, sizeof (title), "VDP demo (%d fps)", frame_count);
 			glfwSetWindowTitle(window, title);
@@ -188,16 +221,20 @@ int main() {
 			frame_count = 0;
 		}
 
-		int width, height;
-		glfwGetFramebufferSize(window, &width, &height);
+		int width = VDP_FRAMEBUFFER_WIDTH * 2, height = VDP_FRAMEBUFFER_HEIGHT * 2;
+		if (!headless) {
+			glfwGetFramebufferSize(window, &width, &height);
+		}
 		int zoom = imax(imin(width / VDP_FRAMEBUFFER_WIDTH, height / VDP_FRAMEBUFFER_HEIGHT), 1);
 		int vdp_width = zoom * VDP_FRAMEBUFFER_WIDTH;
 		int vdp_height = zoom * VDP_FRAMEBUFFER_HEIGHT;
 		int vdp_x = (width - vdp_width) / 2;
 		int vdp_y = (height - vdp_height) / 2;
 
-		double xpos, ypos;
-		glfwGetCursorPos(window, &xpos, &ypos);
+		double xpos = width / 2 + width / 4 * cos(t), ypos = height / 2 + height / 4 * sin(t);
+		if (!headless) {
+			glfwGetCursorPos(window, &xpos, &ypos);
+		}
 		xpos = (xpos - vdp_x) / zoom;
 		ypos = (ypos - vdp_y) / zoom;
 		//vdp_set_window_coord(vdp, xpos, ypos);
@@ -241,16 +278,24 @@ int main() {
 		vdp_set_vscroll(vdp, VDP_PLANE_A, 0, VDP_VSCROLL_COUNT, &vscroll_table[VDP_PLANE_A][0]);
 		vdp_set_vscroll(vdp, VDP_PLANE_B, 0, VDP_VSCROLL_COUNT, &vscroll_table[VDP_PLANE_B][0]);
 
-		glViewport(0, 0, width, height);
-		glClear(GL_COLOR_BUFFER_BIT);
 		vdp_render(vdp);
-		vdp_blit(vdp, vdp_x, vdp_y, vdp_width, vdp_height, VDP_FILTER_NEAREST);
+		if (!headless) {
+			glViewport(0, 0, width, height);
+			glClear(GL_COLOR_BUFFER_BIT);
+			vdp_blit(vdp, vdp_x, vdp_y, vdp_width, vdp_height, VDP_FILTER_NEAREST);
 
-		glfwPollEvents();
-		glfwSwapBuffers(window);
+			glfwPollEvents();
+			glfwSwapBuffers(window);
+		}
+	}
+	if (headless) {
+		glFinish();
+		double elapsed = get_time() - start_t;
+		printf("%u frames in %.3f s (%.1f fps)\n", frames, elapsed, frames / elapsed);
 	}
 	vdp_destroy_context(vdp);
 	glfwDestroyWindow(window);
+	vdp_destroy_headless(headless_context);
 
 	return 0;
 }
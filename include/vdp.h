@@ -20,8 +20,16 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 typedef struct vdp_context vdp_context_t;
+typedef struct vdp_headless vdp_headless_t;
+typedef struct vdp_batch vdp_batch_t;
+typedef struct vdp_device vdp_device_t;
+typedef struct vdp_replay vdp_replay_t;
+typedef struct vdp_pack vdp_pack_t;
+typedef struct vdp_queue vdp_queue_t;
 
 enum {
 	VDP_FRAMEBUFFER_WIDTH = 320,
@@ -37,8 +45,20 @@ enum {
 	VDP_SPRITE_COUNT = 128,
 	VDP_HSCROLL_COUNT = 256,
 	VDP_VSCROLL_COUNT = VDP_FRAMEBUFFER_WIDTH / VDP_PATTERN_WIDTH / 2,
+	VDP_VRAM_SIZE = 0x10000,
+	VDP_CRAM_COUNT = 64,
+	VDP_VSRAM_COUNT = 40,
+	VDP_REGISTER_COUNT = 24,
+	VDP_MAX_SWAP_COUNT = 4,
 };
 
+typedef enum vdp_backend {
+	VDP_BACKEND_OPENGL,
+	VDP_BACKEND_REFERENCE,
+	VDP_BACKEND_SOFTWARE,
+	VDP_BACKEND_COMPUTE
+} vdp_backend_t;
+
 typedef enum vdp_mode {
 	VDP_MODE_NORMAL,
 	VDP_MODE_INTENSITY
@@ -55,6 +75,53 @@ typedef enum vdp_filter {
 	VDP_FILTER_BILINEAR
 } vdp_filter_t;
 
+typedef enum vdp_format {
+	VDP_FORMAT_RGBA8,
+	VDP_FORMAT_RGB565,
+	VDP_FORMAT_INDEX8
+} vdp_format_t;
+
+typedef enum vdp_present_mode {
+	VDP_PRESENT_FIFO,
+	VDP_PRESENT_MAILBOX
+} vdp_present_mode_t;
+
+typedef enum vdp_table {
+	VDP_TABLE_COLORS,
+	VDP_TABLE_PATTERNS,
+	VDP_TABLE_SPRITES,
+	VDP_TABLE_CELLS,
+	VDP_TABLE_HSCROLL,
+	VDP_TABLE_VSCROLL,
+	VDP_TABLE_VRAM,
+	VDP_TABLE_CRAM,
+	VDP_TABLE_VSRAM,
+	VDP_TABLE_REGISTERS,
+	VDP_TABLE_COUNT
+} vdp_table_t;
+
+typedef struct vdp_upload_stats {
+	uint64_t submitted_bytes[VDP_TABLE_COUNT];
+	uint64_t uploaded_bytes[VDP_TABLE_COUNT];
+} vdp_upload_stats_t;
+
+typedef struct vdp_stats {
+	uint64_t frame_count;
+	double render_ms;
+	double blit_ms;
+	unsigned int set_calls;
+	uint64_t uploaded_bytes[VDP_TABLE_COUNT];
+	double frame_ms_min;
+	double frame_ms_avg;
+	double frame_ms_p99;
+} vdp_stats_t;
+
+typedef struct vdp_frame {
+	unsigned int texture;
+	unsigned int layer;
+	uint64_t number;
+} vdp_frame_t;
+
 typedef union vdp_color {
 	struct {
 		uint8_t r;
@@ -86,18 +153,54 @@ typedef struct vdp_sprite {
 	uint16_t x;
 } vdp_sprite_t;
 
+typedef struct vdp_pack_map {
+	unsigned int width;
+	unsigned int height;
+	const vdp_cell_t *cells;
+} vdp_pack_map_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+vdp_headless_t *vdp_create_headless();
+void vdp_destroy_headless(vdp_headless_t *headless);
+void vdp_bind_headless(vdp_headless_t *headless);
+void vdp_unbind_headless(vdp_headless_t *headless);
+
+void vdp_set_program_cache(const char *path);
+
+vdp_device_t *vdp_create_device();
+void vdp_destroy_device(vdp_device_t *device);
+
 vdp_context_t *vdp_create_context();
+vdp_context_t *vdp_create_backend_context(vdp_backend_t backend);
+vdp_context_t *vdp_create_device_context(vdp_device_t *device, vdp_backend_t backend);
 void vdp_destroy_context(vdp_context_t *context);
 
+vdp_batch_t *vdp_create_batch(unsigned int count);
+vdp_batch_t *vdp_create_device_batch(vdp_device_t *device, unsigned int count);
+void vdp_destroy_batch(vdp_batch_t *batch);
+vdp_context_t *vdp_get_batch_context(vdp_batch_t *batch, unsigned int i);
+
+vdp_queue_t *vdp_create_queue(size_t capacity);
+void vdp_destroy_queue(vdp_queue_t *queue);
+vdp_context_t *vdp_create_queue_context(vdp_queue_t *queue);
+bool vdp_run_queue(vdp_queue_t *queue, vdp_context_t *context);
+
+void vdp_set_worker_count(vdp_context_t *context, unsigned int count);
+bool vdp_set_output_format(vdp_context_t *context, vdp_format_t format);
+bool vdp_set_swap_chain(vdp_context_t *context, unsigned int count, vdp_present_mode_t mode);
+
+void vdp_set_line(vdp_context_t *context, unsigned int line);
 void vdp_set_mode(vdp_context_t *context, vdp_mode_t mode);
 void vdp_set_background_color(vdp_context_t *context, unsigned int i);
 void vdp_set_plane_size(vdp_context_t *context, unsigned int width, unsigned int height);
 void vdp_set_window_coord(vdp_context_t *context, int x, int y);
 
+void vdp_begin_update(vdp_context_t *context);
+void vdp_commit_update(vdp_context_t *context);
+
 void vdp_set_colors(vdp_context_t *context, unsigned int start, unsigned int count, const vdp_color_t *data);
 void vdp_set_colors_sh(vdp_context_t *context, unsigned int start, unsigned int count, const vdp_color_t *data);
 void vdp_set_patterns(vdp_context_t *context, unsigned int start, unsigned int count, const uint32_t *data);
@@ -106,8 +209,38 @@ void vdp_set_cells(vdp_context_t *context, vdp_plane_t plane, unsigned int x, un
 void vdp_set_hscroll(vdp_context_t *context, vdp_plane_t plane, unsigned int start, unsigned int count, const uint16_t *data);
 void vdp_set_vscroll(vdp_context_t *context, vdp_plane_t plane, unsigned int start, unsigned int count, const uint16_t *data);
 
+void vdp_set_vram(vdp_context_t *context, unsigned int start, unsigned int count, const uint8_t *data);
+void vdp_set_cram(vdp_context_t *context, unsigned int start, unsigned int count, const uint16_t *data);
+void vdp_set_vsram(vdp_context_t *context, unsigned int start, unsigned int count, const uint16_t *data);
+void vdp_set_registers(vdp_context_t *context, unsigned int start, unsigned int count, const uint8_t *data);
+
+void vdp_get_upload_stats(vdp_context_t *context, vdp_upload_stats_t *stats);
+void vdp_reset_upload_stats(vdp_context_t *context);
+void vdp_get_stats(vdp_context_t *context, vdp_stats_t *stats);
+
+bool vdp_start_trace(vdp_context_t *context, const char *path);
+void vdp_stop_trace(vdp_context_t *context);
+bool vdp_start_capture(vdp_context_t *context, const char *path);
+void vdp_stop_capture(vdp_context_t *context);
+vdp_replay_t *vdp_open_replay(const char *path);
+void vdp_close_replay(vdp_replay_t *replay);
+void vdp_rewind_replay(vdp_replay_t *replay);
+bool vdp_replay_frame(vdp_replay_t *replay, vdp_context_t *context, uint64_t *time);
+vdp_pack_t *vdp_open_pack(const char *path);
+void vdp_close_pack(vdp_pack_t *pack);
+const vdp_color_t *vdp_get_pack_colors(const vdp_pack_t *pack, unsigned int *count);
+const uint32_t *vdp_get_pack_patterns(const vdp_pack_t *pack, unsigned int *count);
+bool vdp_get_pack_map(const vdp_pack_t *pack, unsigned int index, vdp_pack_map_t *map);
+
 void vdp_render(vdp_context_t *context);
+void vdp_render_batch(vdp_batch_t *batch);
+void vdp_render_to(vdp_context_t *context, unsigned int fbo, unsigned int x, unsigned int y, unsigned int width, unsigned int height);
+bool vdp_present(vdp_context_t *context);
+bool vdp_get_frame(vdp_context_t *context, vdp_frame_t *frame);
 void vdp_blit(vdp_context_t *context, unsigned int x, unsigned int y, unsigned int width, unsigned int height, vdp_filter_t filter);
+void vdp_read_pixels(vdp_context_t *context, void *pixels);
+bool vdp_read_async(vdp_context_t *context);
+bool vdp_read_poll(vdp_context_t *context, void *pixels);
 
 #ifdef __cplusplus
 }
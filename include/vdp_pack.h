@@ -0,0 +1,46 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// A pack as written by glvdp_pack: this header, the palettes as vdp_color_t, the patterns, the map
+// entries, then the cells of every map row by row. Offsets are from the start of the file and every
+// section is 4 byte aligned so that a mapped pack is handed to the setters in place.
+enum {
+	VDP_PACK_VERSION = 1,
+};
+
+typedef struct vdp_pack_header {
+	char magic[4]; // "GVPK"
+	uint32_t version;
+	uint32_t color_count;
+	uint32_t color_offset;
+	uint32_t pattern_count;
+	uint32_t pattern_offset;
+	uint32_t map_count;
+	uint32_t map_offset;
+} vdp_pack_header_t;
+
+typedef struct vdp_pack_entry {
+	uint32_t width; // in cells
+	uint32_t height;
+	uint32_t offset;
+} vdp_pack_entry_t;
@@ -18,13 +18,16 @@
  */
 
 #include <vdp.h>
+#include "vdp_internal.h"
 
 #include <GL/glcorearb.h>
 #include <GL/gl3w.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
+#include <time.h>
 
 static const GLchar vdp_geometry_glsl[] = {
 #include "vdp.geometry.glsl.i"
@@ -38,23 +41,207 @@ static const GLchar vdp_fragment_glsl[] = {
 #include "vdp.fragment.glsl.i"
 };
 
-struct vdp_context {
-	GLuint program;
+static const GLchar vdp_unpack_glsl[] = {
+#include "vdp.unpack.glsl.i"
+};
+
+static const GLchar vdp_sprites_glsl[] = {
+#include "vdp.sprites.glsl.i"
+};
+
+static const GLchar vdp_decode_glsl[] = {
+#include "vdp.decode.glsl.i"
+};
+
+static const GLchar vdp_compute_glsl[] = {
+#include "vdp.compute.glsl.i"
+};
+
+static const GLchar vdp_yuv_glsl[] = {
+#include "vdp.yuv.glsl.i"
+};
+
+enum {
+	READBACK_COUNT = 3,
+	RUN_GAP_SIZE = 64,
+	UNPACK_GROUP_SIZE = 64,
+	DECODE_GROUP_SIZE = 64,
+	SPRITES_GROUP_SIZE = 32,
+	YUV_GROUP_SIZE = 8,
+	STAGING_SEGMENT_COUNT = 3,
+	STAGING_SEGMENT_SIZE = 256 * 1024,
+	FRAME_TIME_COUNT = 128,
+	PLANE_SIZE_VARIANT_COUNT = 9,
+	OUTPUT_FORMAT_COUNT = VDP_FORMAT_INDEX8 + 1,
+	PROGRAM_VARIANT_COUNT = 3 * 2 * (PLANE_SIZE_VARIANT_COUNT + 1) * OUTPUT_FORMAT_COUNT,
+	FRAMEBUFFER_SIZE = VDP_FRAMEBUFFER_WIDTH * VDP_FRAMEBUFFER_HEIGHT * sizeof (uint32_t),
+};
+
+typedef struct readback {
+	size_t pitch;
+	GLuint buffer;
+	GLsync fence;
+	void *data;
+} readback_t;
+
+typedef struct upload {
+	vdp_table_t table;
+	unsigned int layer;
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+	size_t offset;
+} upload_t;
+
+typedef struct staging {
+	GLuint buffer;
+	uint8_t *data;
+	GLsync fences[STAGING_SEGMENT_COUNT];
+	unsigned int segment;
+	size_t used;
+	upload_t *uploads;
+	unsigned int upload_count;
+	unsigned int upload_capacity;
+	bool active;
+} staging_t;
+
+// GL_TIME_ELAPSED query pair, each frame reuses the query issued two frames ago so reading never stalls.
+typedef struct gpu_timer {
+	GLuint queries[2];
+	bool pending[2];
+	unsigned int index;
+	double ms;
+} gpu_timer_t;
+
+// Registers baked into a program variant as constants, -1 when they change from one line to the next.
+typedef struct program_variant {
+	int intensity_mode;
+	int window; // 0 when no line has a window
+	int plane_size; // 3 * log2(width / 32) + log2(height / 32) for 32, 64 and 128 cells
+	vdp_format_t format;
+} program_variant_t;
+
+// Framebuffer texture and readback layout of an output format.
+typedef struct output_format {
+	GLenum internal_format;
+	GLenum format;
+	GLenum type;
+	size_t pixel_size;
+} output_format_t;
+
+// RGB565 is packed by the shaders, images cannot be RGB565 and drivers do not all round the same way.
+static const output_format_t output_formats[OUTPUT_FORMAT_COUNT] = {
+	{ GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, 4 },
+	{ GL_R16UI, GL_RED_INTEGER, GL_UNSIGNED_SHORT, 2 },
+	{ GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE, 1 },
+};
+
+// Render writes the back buffer, vdp_present queues it and vdp_get_frame makes a queued frame the front buffer
+// that blits and reads use. With a single buffer all three are the same, with two a present swaps front and back.
+typedef struct swap_chain {
+	unsigned int count;
+	vdp_present_mode_t mode;
+	unsigned int back;
+	unsigned int front;
+	unsigned int queue[VDP_MAX_SWAP_COUNT]; // oldest first
+	unsigned int queued;
+	uint64_t numbers[VDP_MAX_SWAP_COUNT]; // present number of the frame in each buffer
+	uint64_t presented;
+	uint64_t acquired;
+} swap_chain_t;
+
+// Per frame counters, plus the duration of the last FRAME_TIME_COUNT frames.
+typedef struct frame_stats {
+	vdp_stats_t last;
+	unsigned int set_calls;
+	uint64_t uploaded_bytes[VDP_TABLE_COUNT];
+	double frame_start;
+	double frame_ms[FRAME_TIME_COUNT];
+	unsigned int frame_head;
+	unsigned int frame_count;
+} frame_stats_t;
+
+// Everything that does not depend on VDP state, shared by the batches created from it. GL names are only valid
+// in the GL context that created the device and the contexts sharing objects with it.
+struct vdp_device {
+	unsigned int ref_count;
+	GLuint programs[2][PROGRAM_VARIANT_COUNT]; // drawing then compute, built on first use, the first of each format reads every register per line
+	GLuint unpack_program;
+	GLuint sprites_program;
+	GLuint decode_program;
+	GLuint yuv_program; // built by the first capture
 	GLuint vao;
+};
+
+struct vdp_batch {
+	unsigned int count;
+	vdp_context_t **contexts;
+	vdp_device_t *device;
+	bool compute;
+	vdp_format_t format;
 	GLuint color_tex;
 	GLuint pattern_tex;
+	GLuint pattern_index_tex;
 	GLuint sprite_tex;
 	GLuint plane_tex;
 	GLuint hscroll_tex;
 	GLuint vscroll_tex;
-	GLuint framebuffer_tex;
-	GLuint framebuffer_fbo;
+	GLuint register_tex;
+	GLuint sprite_line_tex;
+	GLuint framebuffer_tex[VDP_MAX_SWAP_COUNT];
+	GLuint framebuffer_fbo[VDP_MAX_SWAP_COUNT];
+	unsigned int buffer_count; // swap buffers allocated, enough for the longest chain of the batch
+	gpu_timer_t render_timer;
+};
+
+struct vdp_context {
+	vdp_backend_t backend;
+	vdp_format_t format;
+	vdp_state_t state;
+	vdp_native_t native;
+	bool native_dirty;
+	bool shadow_stale;
+	uint32_t *pixels; // one frame per swap buffer
+	vdp_software_t *software;
+	vdp_batch_t *batch;
+	bool owns_batch;
+	GLint layer;
+	unsigned int line;
+	unsigned int dirty_line;
+	bool raster;
+	GLuint native_buffer;
+	unsigned int decode_first;
+	unsigned int decode_last;
+	vdp_upload_stats_t upload_stats;
+	frame_stats_t stats;
+	gpu_timer_t render_timer;
+	gpu_timer_t blit_timer;
+	bool batch_rendered;
+	vdp_trace_t *trace;
+	vdp_queue_t *queue; // calls are recorded for another thread instead
+	staging_t staging;
+	swap_chain_t chain;
+	GLuint framebuffer_fbo[VDP_MAX_SWAP_COUNT];
+	readback_t readbacks[READBACK_COUNT];
+	unsigned int readback_head;
+	unsigned int readback_count;
+	vdp_capture_t *capture;
+	readback_t captures[READBACK_COUNT];
+	unsigned int capture_head;
+	unsigned int capture_count;
 };
 
-static GLuint create_shader_from_source(GLenum type, const GLchar *source) {
+static GLuint create_shader_from_source(GLenum type, const GLchar *source, const GLchar *defines) {
+	// defines go right after the #version line
+	const GLchar *body = strstr(source, "#version");
+	body = body ? strchr(body, '\n') : NULL;
+	body = body ? body + 1 : source;
+	const GLchar *strings[] = { source, defines ? defines : "", body };
+	GLint size = (GLint)(body - source);
+	const GLint sizes[] = { size, -1, -1 };
 	GLuint shader = glCreateShader(type);
-	GLint size = (GLint)strlen(source);
-	glShaderSource(shader, 1, &source, &size);
+	glShaderSource(shader, 3, strings, sizes);
 	glCompileShader(shader);
 	GLint success;
 	glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
@@ -70,10 +257,119 @@ static GLuint create_shader_from_source(GLenum type, const GLchar *source) {
 	return shader;
 }
 
-static GLuint create_program_from_source(const GLenum types[], const GLchar *sources[], GLuint num) {
+// Directory of the program binary cache, NULL when disabled.
+static char *program_cache = NULL;
+
+// Program binary cache file: magic, binary format, binary size, then the binary itself.
+typedef struct program_cache_header {
+	char magic[4];
+	uint32_t format;
+	uint32_t size;
+} program_cache_header_t;
+
+static uint64_t hash_string(uint64_t hash, const char *string) {
+	// FNV-1a, the terminator is hashed too so that consecutive strings cannot run into each other
+	do {
+		hash = (hash ^ (uint8_t)*string) * 0x100000001b3;
+	} while (*string++);
+	return hash;
+}
+
+static bool get_program_cache_path(const GLenum types[], const GLchar *sources[], GLuint num, const GLchar *defines, char *path, size_t size) {
+	if (!program_cache) {
+		return false;
+	}
+	GLint format_count = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &format_count);
+	if (format_count <= 0) {
+		return false;
+	}
+	uint64_t hash = 0xcbf29ce484222325;
+	hash = hash_string(hash, (const char *)glGetString(GL_RENDERER));
+	hash = hash_string(hash, (const char *)glGetString(GL_VERSION));
+	hash = hash_string(hash, defines ? defines : "");
+	for (GLuint i = 0; i < num; ++i) {
+		char type[16];
+		snprintf(type, sizeof (type), "%x", types[i]);
+		hash = hash_string(hash, type);
+		hash = hash_string(hash, sources[i]);
+	}
+	int length = snprintf(path, size, "%s/glvdp-%016llx.bin", program_cache, (unsigned long long)hash);
+	return length > 0 && (size_t)length < size;
+}
+
+static GLuint load_program_binary(const char *path) {
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		return 0;
+	}
+	GLuint program = 0;
+	program_cache_header_t header;
+	fseek(file, 0, SEEK_END);
+	const long size = ftell(file);
+	rewind(file);
+	if (fread(&header, sizeof (header), 1, file) == 1 && !memcmp(header.magic, "GVPB", 4) && header.size == size - (long)sizeof (header)) {
+		void *binary = malloc(header.size);
+		if (binary && fread(binary, 1, header.size, file) == header.size) {
+			// a binary from another driver build simply fails to link
+			program = glCreateProgram();
+			glProgramBinary(program, header.format, binary, (GLsizei)header.size);
+			GLint success;
+			glGetProgramiv(program, GL_LINK_STATUS, &success);
+			if (!success) {
+				glDeleteProgram(program);
+				program = 0;
+			}
+		}
+		free(binary);
+	}
+	fclose(file);
+	return program;
+}
+
+static void save_program_binary(GLuint program, const char *path) {
+	GLint size = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+	if (size <= 0) {
+		return;
+	}
+	program_cache_header_t header = { { 'G', 'V', 'P', 'B' }, 0, 0 };
+	void *binary = malloc((size_t)size);
+	GLenum format;
+	glGetProgramBinary(program, size, &size, &format, binary);
+	header.format = format;
+	header.size = (uint32_t)size;
+
+	// write to a temporary file first so that concurrent processes never read a partial binary
+	char temp_path[1024];
+	const int length = snprintf(temp_path, sizeof (temp_path), "%s.%lx%p.tmp", path, (unsigned long)time(NULL), binary);
+	FILE *file = length > 0 && (size_t)length < sizeof (temp_path) ? fopen(temp_path, "wb") : NULL;
+	if (file) {
+		bool success = fwrite(&header, sizeof (header), 1, file) == 1 && fwrite(binary, 1, (size_t)size, file) == (size_t)size;
+		success = !fclose(file) && success;
+		if (!success || rename(temp_path, path)) {
+			remove(temp_path);
+		}
+	}
+	free(binary);
+}
+
+static GLuint create_program_from_source(const GLenum types[], const GLchar *sources[], GLuint num, const GLchar *defines) {
+	char cache_path[1024];
+	const bool cached = get_program_cache_path(types, sources, num, defines, cache_path, sizeof (cache_path));
+	if (cached) {
+		GLuint program = load_program_binary(cache_path);
+		if (program) {
+			return program;
+		}
+	}
+
 	GLuint program = glCreateProgram();
+	if (cached) {
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
 	for (GLuint i = 0; i < num; ++i) {
-		GLuint shader = create_shader_from_source(types[i], sources[i]);
+		GLuint shader = create_shader_from_source(types[i], sources[i], defines);
 		if (!shader) {
 			glDeleteProgram(program);
 			return 0;
@@ -90,118 +386,859 @@ static GLuint create_program_from_source(const GLenum types[], const GLchar *sou
 		GLchar *log = malloc((size_t)size);
 		glGetProgramInfoLog(program, size, &size, log);
 		fprintf(stderr, "%s\n", log);
+		free(log);
 		glDeleteProgram(program);
 		return 0;
 	}
+	if (cached) {
+		save_program_binary(program, cache_path);
+	}
 	return program;
 }
 
-vdp_context_t *vdp_create_context() {
+void vdp_set_program_cache(const char *path) {
+	free(program_cache);
+	program_cache = NULL;
+	if (path) {
+		program_cache = malloc(strlen(path) + 1);
+		strcpy(program_cache, path);
+	}
+}
+
+static vdp_context_t *alloc_context(vdp_backend_t backend) {
 	vdp_context_t *context = calloc(1, sizeof (vdp_context_t));
+	context->backend = backend;
+	context->chain.count = 1;
+	for (unsigned int i = 0; i < VDP_FRAMEBUFFER_HEIGHT; ++i) {
+		context->state.lines[i].plane_size[0] = 32;
+		context->state.lines[i].plane_size[1] = 32;
+	}
+	return context;
+}
+
+static uint32_t *frame_pixels(vdp_context_t *context, unsigned int buffer) {
+	return context->pixels + buffer * VDP_FRAMEBUFFER_WIDTH * VDP_FRAMEBUFFER_HEIGHT;
+}
+
+static void free_context(vdp_context_t *context) {
+	vdp_stop_capture(context);
+	// only OpenGL contexts own GL objects, the others must not touch GL at all
+	if (context->backend == VDP_BACKEND_OPENGL) {
+		for (unsigned int i = 0; i < READBACK_COUNT; ++i) {
+			glDeleteSync(context->readbacks[i].fence);
+			glDeleteBuffers(1, &context->readbacks[i].buffer);
+		}
+		for (unsigned int i = 0; i < STAGING_SEGMENT_COUNT; ++i) {
+			glDeleteSync(context->staging.fences[i]);
+		}
+		glDeleteBuffers(1, &context->staging.buffer);
+		glDeleteBuffers(1, &context->native_buffer);
+		glDeleteQueries(2, context->render_timer.queries);
+		glDeleteQueries(2, context->blit_timer.queries);
+		glDeleteFramebuffers(VDP_MAX_SWAP_COUNT, context->framebuffer_fbo);
+	} else {
+		for (unsigned int i = 0; i < READBACK_COUNT; ++i) {
+			free(context->readbacks[i].data);
+		}
+	}
+	free(context->staging.uploads);
+	vdp_destroy_software(context->software);
+	vdp_destroy_trace(context->trace);
+	free(context->pixels);
+	free(context);
+}
+
+static void flush_registers(vdp_context_t *context) {
+	const unsigned int first = context->dirty_line;
+	if (first < VDP_FRAMEBUFFER_HEIGHT) {
+		glTextureSubImage3D(context->batch->register_tex, 0, 0, (GLint)first, context->layer, 2, VDP_FRAMEBUFFER_HEIGHT - (GLsizei)first, 1, GL_RGBA_INTEGER, GL_INT, &context->state.lines[first]);
+		context->dirty_line = VDP_FRAMEBUFFER_HEIGHT;
+	}
+}
+
+// Final pass of the batch, specialized for the registers of variant.
+static GLuint create_render_program(bool compute, const program_variant_t *variant) {
+	char defines[256] = "";
+	size_t length = 0;
+	if (variant->intensity_mode >= 0) {
+		length += (size_t)snprintf(defines + length, sizeof (defines) - length, "#define INTENSITY_MODE %s\n", variant->intensity_mode ? "true" : "false");
+	}
+	if (variant->window >= 0) {
+		length += (size_t)snprintf(defines + length, sizeof (defines) - length, "#define WINDOW ivec2(0, 0)\n");
+	}
+	if (variant->plane_size >= 0) {
+		length += (size_t)snprintf(defines + length, sizeof (defines) - length, "#define PLANE_SIZE uvec2(%u, %u)\n", 32u << (variant->plane_size / 3), 32u << (variant->plane_size % 3));
+	}
+	if (variant->format != VDP_FORMAT_RGBA8) {
+		snprintf(defines + length, sizeof (defines) - length, "#define %s\n", variant->format == VDP_FORMAT_RGB565 ? "OUTPUT_RGB565" : "OUTPUT_INDEX8");
+	}
+	if (compute) {
+		const GLenum types[] = { GL_COMPUTE_SHADER };
+		const GLchar *sources[] = { vdp_compute_glsl };
+		return create_program_from_source(types, sources, 1, defines);
+	}
+	const GLenum types[] = { GL_GEOMETRY_SHADER, GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+	const GLchar *sources[] = { vdp_geometry_glsl, vdp_vertex_glsl, vdp_fragment_glsl };
+	return create_program_from_source(types, sources, 3, defines);
+}
+
+// The generic program of every format comes first, at index format.
+static unsigned int variant_index(const program_variant_t *variant) {
+	const unsigned int registers = ((unsigned int)(variant->intensity_mode + 1) * 2 + (unsigned int)(variant->window + 1)) * (PLANE_SIZE_VARIANT_COUNT + 1) + (unsigned int)(variant->plane_size + 1);
+	return registers * OUTPUT_FORMAT_COUNT + (unsigned int)variant->format;
+}
 
-	// program
-	GLenum shader_types[] = { GL_GEOMETRY_SHADER, GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
-	const GLchar *shader_sources[] = { vdp_geometry_glsl, vdp_vertex_glsl, vdp_fragment_glsl };
-	context->program = create_program_from_source(shader_types, shader_sources, 3);
-	if (!context->program) {
-		vdp_destroy_context(context);
+// Creates swap buffers first to count - 1, each a texture with a layer per instance, a layered framebuffer object
+// to draw the whole batch and a framebuffer object per instance for blits and single renders.
+static void create_framebuffers(vdp_batch_t *batch, unsigned int first, unsigned int count) {
+	for (unsigned int i = first; i < count; ++i) {
+		glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &batch->framebuffer_tex[i]);
+		glTextureStorage3D(batch->framebuffer_tex[i], 1, output_formats[batch->format].internal_format, VDP_FRAMEBUFFER_WIDTH, VDP_FRAMEBUFFER_HEIGHT, (GLsizei)batch->count);
+		glTextureParameteri(batch->framebuffer_tex[i], GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTextureParameteri(batch->framebuffer_tex[i], GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		if (!batch->framebuffer_fbo[i]) {
+			glCreateFramebuffers(1, &batch->framebuffer_fbo[i]);
+		}
+		glNamedFramebufferTexture(batch->framebuffer_fbo[i], GL_COLOR_ATTACHMENT0, batch->framebuffer_tex[i], 0);
+		GLenum fbstatus = glCheckNamedFramebufferStatus(batch->framebuffer_fbo[i], GL_FRAMEBUFFER);
+		assert(fbstatus == GL_FRAMEBUFFER_COMPLETE);
+		for (unsigned int j = 0; j < batch->count; ++j) {
+			vdp_context_t *context = batch->contexts[j];
+			if (!context->framebuffer_fbo[i]) {
+				glCreateFramebuffers(1, &context->framebuffer_fbo[i]);
+			}
+			glNamedFramebufferTextureLayer(context->framebuffer_fbo[i], GL_COLOR_ATTACHMENT0, batch->framebuffer_tex[i], 0, context->layer);
+			fbstatus = glCheckNamedFramebufferStatus(context->framebuffer_fbo[i], GL_FRAMEBUFFER);
+			assert(fbstatus == GL_FRAMEBUFFER_COMPLETE);
+		}
+	}
+	batch->buffer_count = count > batch->buffer_count ? count : batch->buffer_count;
+}
+
+vdp_device_t *vdp_create_device() {
+	vdp_device_t *device = calloc(1, sizeof (vdp_device_t));
+	device->ref_count = 1;
+
+	// programs, the render programs are only built when a batch needs them
+	GLenum unpack_types[] = { GL_COMPUTE_SHADER };
+	const GLchar *unpack_sources[] = { vdp_unpack_glsl };
+	device->unpack_program = create_program_from_source(unpack_types, unpack_sources, 1, NULL);
+	const GLchar *sprites_sources[] = { vdp_sprites_glsl };
+	device->sprites_program = create_program_from_source(unpack_types, sprites_sources, 1, NULL);
+	const GLchar *decode_sources[] = { vdp_decode_glsl };
+	device->decode_program = create_program_from_source(unpack_types, decode_sources, 1, NULL);
+	if (!device->unpack_program || !device->sprites_program || !device->decode_program) {
+		vdp_destroy_device(device);
 		return NULL;
 	}
 
 	// vertex array object
-	glCreateVertexArrays(1, &context->vao);
+	glCreateVertexArrays(1, &device->vao);
+	return device;
+}
+
+// Drops one reference, the device goes away with the last batch using it.
+void vdp_destroy_device(vdp_device_t *device) {
+	if (device && --device->ref_count == 0) {
+		for (unsigned int i = 0; i < 2; ++i) {
+			for (unsigned int j = 0; j < PROGRAM_VARIANT_COUNT; ++j) {
+				if (j < OUTPUT_FORMAT_COUNT || device->programs[i][j] != device->programs[i][j % OUTPUT_FORMAT_COUNT]) {
+					glDeleteProgram(device->programs[i][j]);
+				}
+			}
+		}
+		glDeleteProgram(device->unpack_program);
+		glDeleteProgram(device->sprites_program);
+		glDeleteProgram(device->decode_program);
+		glDeleteProgram(device->yuv_program);
+		glDeleteVertexArrays(1, &device->vao);
+		free(device);
+	}
+}
+
+// The compute backend shares everything but the final pass, it renders with a compute shader instead of drawing.
+// Batches without a device get one of their own.
+static vdp_batch_t *create_batch(vdp_device_t *device, unsigned int count, vdp_backend_t backend) {
+	GLint max_layers;
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+	if (count == 0 || count * VDP_PLANE_COUNT > (unsigned int)max_layers) {
+		fprintf(stderr, "Unsupported VDP batch size %u.\n", count);
+		return NULL;
+	}
+	if (device) {
+		++device->ref_count;
+	} else if (!(device = vdp_create_device())) {
+		return NULL;
+	}
+
+	vdp_batch_t *batch = calloc(1, sizeof (vdp_batch_t));
+	batch->contexts = calloc(count, sizeof (vdp_context_t *));
+	batch->device = device;
+	batch->compute = backend == VDP_BACKEND_COMPUTE;
+
+	// generic render program, the specialized variants are only built when a frame needs them
+	GLuint *programs = device->programs[batch->compute];
+	if (!programs[0]) {
+		const program_variant_t generic = { -1, -1, -1, VDP_FORMAT_RGBA8 };
+		programs[0] = create_render_program(batch->compute, &generic);
+		if (!programs[0]) {
+			vdp_destroy_batch(batch);
+			return NULL;
+		}
+	}
+
+	// every table gets one layer (or one layer per plane) per instance
 
 	// color palette texture
-	glCreateTextures(GL_TEXTURE_1D, 1, &context->color_tex);
-	glTextureStorage1D(context->color_tex, 1, GL_RGBA8, VDP_COLOR_COUNT * 4);
-	glTextureParameteri(context->color_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTextureParameteri(context->color_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &batch->color_tex);
+	glTextureStorage3D(batch->color_tex, 1, GL_RGBA8, VDP_COLOR_COUNT * 4, VDP_PALETTE_COUNT, (GLsizei)count);
+	glTextureParameteri(batch->color_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTextureParameteri(batch->color_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
-	// pattern texture
-	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &context->pattern_tex);
-	glTextureStorage3D(context->pattern_tex, 1, GL_R32UI, (VDP_PATTERN_WIDTH * VDP_PATTERN_BPP) / 32, VDP_PATTERN_HEIGHT, VDP_PATTERN_COUNT);
-	glTextureParameteri(context->pattern_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTextureParameteri(context->pattern_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	// pattern texture, one row of strips per pattern
+	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &batch->pattern_tex);
+	glTextureStorage3D(batch->pattern_tex, 1, GL_R32UI, VDP_PATTERN_HEIGHT * (VDP_PATTERN_WIDTH * VDP_PATTERN_BPP) / 32, VDP_PATTERN_COUNT, (GLsizei)count);
+	glTextureParameteri(batch->pattern_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTextureParameteri(batch->pattern_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	// decoded pattern texture, one byte per pixel, the only one the fragment shader reads
+	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &batch->pattern_index_tex);
+	glTextureStorage3D(batch->pattern_index_tex, 1, GL_R8UI, VDP_PATTERN_HEIGHT * VDP_PATTERN_WIDTH, VDP_PATTERN_COUNT, (GLsizei)count);
+	glTextureParameteri(batch->pattern_index_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTextureParameteri(batch->pattern_index_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
 	// sprite texture
-	glCreateTextures(GL_TEXTURE_1D, 1, &context->sprite_tex);
-	glTextureStorage1D(context->sprite_tex, 1, GL_RGBA16UI, VDP_SPRITE_COUNT);
-	glTextureParameteri(context->sprite_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTextureParameteri(context->sprite_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glCreateTextures(GL_TEXTURE_1D_ARRAY, 1, &batch->sprite_tex);
+	glTextureStorage2D(batch->sprite_tex, 1, GL_RGBA16UI, VDP_SPRITE_COUNT, (GLsizei)count);
+	glTextureParameteri(batch->sprite_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTextureParameteri(batch->sprite_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
 	// plane texture
-	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &context->plane_tex);
-	glTextureStorage3D(context->plane_tex, 1, GL_R16UI, VDP_PLANE_MAX_WIDTH, VDP_PLANE_MAX_HEIGHT, VDP_PLANE_COUNT);
-	glTextureParameteri(context->plane_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTextureParameteri(context->plane_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &batch->plane_tex);
+	glTextureStorage3D(batch->plane_tex, 1, GL_R16UI, VDP_PLANE_MAX_WIDTH, VDP_PLANE_MAX_HEIGHT, VDP_PLANE_COUNT * (GLsizei)count);
+	glTextureParameteri(batch->plane_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTextureParameteri(batch->plane_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
 	// horizontal scroll texture
-	glCreateTextures(GL_TEXTURE_1D_ARRAY, 1, &context->hscroll_tex);
-	glTextureStorage2D(context->hscroll_tex, 1, GL_R16UI, VDP_HSCROLL_COUNT, 2);
-	glTextureParameteri(context->hscroll_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTextureParameteri(context->hscroll_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glCreateTextures(GL_TEXTURE_1D_ARRAY, 1, &batch->hscroll_tex);
+	glTextureStorage2D(batch->hscroll_tex, 1, GL_R16UI, VDP_HSCROLL_COUNT, 2 * (GLsizei)count);
+	glTextureParameteri(batch->hscroll_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTextureParameteri(batch->hscroll_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
 	// vertical scroll texture
-	glCreateTextures(GL_TEXTURE_1D_ARRAY, 1, &context->vscroll_tex);
-	glTextureStorage2D(context->vscroll_tex, 1, GL_R16UI, VDP_VSCROLL_COUNT, 2);
-	glTextureParameteri(context->vscroll_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTextureParameteri(context->vscroll_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-	// framebuffer texture
-	glCreateTextures(GL_TEXTURE_2D, 1, &context->framebuffer_tex);
-	glTextureStorage2D(context->framebuffer_tex, 1, GL_RGBA8, VDP_FRAMEBUFFER_WIDTH, VDP_FRAMEBUFFER_HEIGHT);
-	glTextureParameteri(context->framebuffer_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTextureParameteri(context->framebuffer_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-	// framebuffer object
-	glCreateFramebuffers(1, &context->framebuffer_fbo);
-	glNamedFramebufferTexture(context->framebuffer_fbo, GL_COLOR_ATTACHMENT0, context->framebuffer_tex, 0);
-	GLenum fbstatus = glCheckNamedFramebufferStatus(context->framebuffer_fbo, GL_FRAMEBUFFER);
-	assert(fbstatus == GL_FRAMEBUFFER_COMPLETE);
+	glCreateTextures(GL_TEXTURE_1D_ARRAY, 1, &batch->vscroll_tex);
+	glTextureStorage2D(batch->vscroll_tex, 1, GL_R16UI, VDP_VSCROLL_COUNT, 2 * (GLsizei)count);
+	glTextureParameteri(batch->vscroll_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTextureParameteri(batch->vscroll_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	// register texture: mode, background color, plane size, window, palette and hscroll layout of every line
+	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &batch->register_tex);
+	glTextureStorage3D(batch->register_tex, 1, GL_RGBA32I, 2, VDP_FRAMEBUFFER_HEIGHT, (GLsizei)count);
+	glTextureParameteri(batch->register_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTextureParameteri(batch->register_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	// sprite line texture: sprite count, then the sprites drawn on every line
+	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &batch->sprite_line_tex);
+	glTextureStorage3D(batch->sprite_line_tex, 1, GL_R16UI, VDP_LINE_SPRITE_COUNT + 1, VDP_FRAMEBUFFER_HEIGHT, (GLsizei)count);
+	glTextureParameteri(batch->sprite_line_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTextureParameteri(batch->sprite_line_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	// table textures start out matching the zeroed shadow copies
+	glClearTexImage(batch->color_tex, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glClearTexImage(batch->pattern_tex, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+	glClearTexImage(batch->pattern_index_tex, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, NULL);
+	glClearTexImage(batch->sprite_tex, 0, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, NULL);
+	glClearTexImage(batch->plane_tex, 0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, NULL);
+	glClearTexImage(batch->hscroll_tex, 0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, NULL);
+	glClearTexImage(batch->vscroll_tex, 0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, NULL);
+
+	// instances, then the single buffer every context starts out with
+	for (unsigned int i = 0; i < count; ++i) {
+		vdp_context_t *context = alloc_context(VDP_BACKEND_OPENGL);
+		context->batch = batch;
+		context->layer = (GLint)i;
+		glCreateBuffers(1, &context->native_buffer);
+		glNamedBufferStorage(context->native_buffer, sizeof (vdp_native_t), &context->native, GL_DYNAMIC_STORAGE_BIT);
+		batch->contexts[batch->count++] = context;
+	}
+	create_framebuffers(batch, 0, 1);
 
+	return batch;
+}
+
+void vdp_destroy_batch(vdp_batch_t *batch) {
+	if (batch) {
+		for (unsigned int i = 0; i < batch->count; ++i) {
+			free_context(batch->contexts[i]);
+		}
+		glDeleteQueries(2, batch->render_timer.queries);
+		vdp_destroy_device(batch->device);
+		glDeleteTextures(1, &batch->color_tex);
+		glDeleteTextures(1, &batch->pattern_tex);
+		glDeleteTextures(1, &batch->pattern_index_tex);
+		glDeleteTextures(1, &batch->sprite_tex);
+		glDeleteTextures(1, &batch->plane_tex);
+		glDeleteTextures(1, &batch->hscroll_tex);
+		glDeleteTextures(1, &batch->vscroll_tex);
+		glDeleteTextures(1, &batch->register_tex);
+		glDeleteTextures(1, &batch->sprite_line_tex);
+		glDeleteFramebuffers(VDP_MAX_SWAP_COUNT, batch->framebuffer_fbo);
+		glDeleteTextures(VDP_MAX_SWAP_COUNT, batch->framebuffer_tex);
+		free(batch->contexts);
+		free(batch);
+	}
+}
+
+vdp_batch_t *vdp_create_batch(unsigned int count) {
+	return create_batch(NULL, count, VDP_BACKEND_OPENGL);
+}
+
+vdp_batch_t *vdp_create_device_batch(vdp_device_t *device, unsigned int count) {
+	return create_batch(device, count, VDP_BACKEND_OPENGL);
+}
+
+vdp_context_t *vdp_get_batch_context(vdp_batch_t *batch, unsigned int i) {
+	return i < batch->count ? batch->contexts[i] : NULL;
+}
+
+vdp_context_t *vdp_create_context() {
+	return vdp_create_backend_context(VDP_BACKEND_OPENGL);
+}
+
+vdp_context_t *vdp_create_backend_context(vdp_backend_t backend) {
+	return vdp_create_device_context(NULL, backend);
+}
+
+vdp_context_t *vdp_create_device_context(vdp_device_t *device, vdp_backend_t backend) {
+	if (backend == VDP_BACKEND_OPENGL || backend == VDP_BACKEND_COMPUTE) {
+		// a standalone context is a batch of one that it owns
+		vdp_batch_t *batch = create_batch(device, 1, backend);
+		if (!batch) {
+			return NULL;
+		}
+		batch->contexts[0]->owns_batch = true;
+		return batch->contexts[0];
+	}
+
+	vdp_context_t *context = alloc_context(backend);
+	context->pixels = calloc(VDP_FRAMEBUFFER_WIDTH * VDP_FRAMEBUFFER_HEIGHT, sizeof (uint32_t));
+	if (backend == VDP_BACKEND_SOFTWARE) {
+		context->software = vdp_create_software(0);
+	}
+	return context;
+}
+
+// Front end for the thread that emulates, its calls are recorded into the queue for vdp_run_queue to replay
+// on the thread that owns the GL context. Only updates, renders and blits are forwarded, everything else
+// acts on a context that never renders. Being a reference context it owns no GL object and never calls GL,
+// so the emulating thread creates and destroys it without a current GL context.
+vdp_context_t *vdp_create_queue_context(vdp_queue_t *queue) {
+	vdp_context_t *context = alloc_context(VDP_BACKEND_REFERENCE);
+	context->pixels = calloc(VDP_FRAMEBUFFER_WIDTH * VDP_FRAMEBUFFER_HEIGHT, sizeof (uint32_t));
+	context->queue = queue;
 	return context;
 }
 
 void vdp_destroy_context(vdp_context_t *context) {
-	if (context) {
-		glDeleteProgram(context->program);
-		glDeleteVertexArrays(1, &context->vao);
-		glDeleteTextures(1, &context->color_tex);
-		glDeleteTextures(1, &context->pattern_tex);
-		glDeleteTextures(1, &context->sprite_tex);
-		glDeleteTextures(1, &context->plane_tex);
-		glDeleteTextures(1, &context->hscroll_tex);
-		glDeleteTextures(1, &context->vscroll_tex);
-		glDeleteFramebuffers(1, &context->framebuffer_fbo);
-		glDeleteTextures(1, &context->framebuffer_tex);
-		free(context);
+	if (context && context->owns_batch) {
+		vdp_destroy_batch(context->batch);
+	} else if (context && !context->batch) {
+		free_context(context);
+	}
+}
+
+void vdp_set_worker_count(vdp_context_t *context, unsigned int count) {
+	if (context->backend == VDP_BACKEND_SOFTWARE) {
+		vdp_destroy_software(context->software);
+		context->software = vdp_create_software(count);
+	}
+}
+
+// Contexts of a batch share their framebuffer, changing the format of one changes them all.
+// Captures only take RGBA8, the format stays put while one is running.
+bool vdp_set_output_format(vdp_context_t *context, vdp_format_t format) {
+	if ((unsigned int)format >= OUTPUT_FORMAT_COUNT) {
+		return false;
+	}
+	if (context->backend != VDP_BACKEND_OPENGL) {
+		if (context->capture && format != VDP_FORMAT_RGBA8) {
+			return false;
+		}
+		context->format = format;
+		return true;
+	}
+	vdp_batch_t *batch = context->batch;
+	if (batch->format == format) {
+		return true;
+	}
+	for (unsigned int i = 0; i < batch->count; ++i) {
+		if (batch->contexts[i]->capture && format != VDP_FORMAT_RGBA8) {
+			return false;
+		}
+	}
+	GLuint *programs = batch->device->programs[batch->compute];
+	if (!programs[format]) {
+		const program_variant_t generic = { -1, -1, -1, format };
+		programs[format] = create_render_program(batch->compute, &generic);
+		if (!programs[format]) {
+			return false;
+		}
+	}
+
+	glDeleteTextures(VDP_MAX_SWAP_COUNT, batch->framebuffer_tex);
+	batch->format = format;
+	create_framebuffers(batch, 0, batch->buffer_count);
+	for (unsigned int i = 0; i < batch->count; ++i) {
+		batch->contexts[i]->format = format;
+	}
+	return true;
+}
+
+// Drops queued frames, the front buffer stays where it is when the chain is still long enough. GL buffers are
+// shared by the contexts of a batch and only ever grow.
+bool vdp_set_swap_chain(vdp_context_t *context, unsigned int count, vdp_present_mode_t mode) {
+	if (count == 0 || count > VDP_MAX_SWAP_COUNT) {
+		return false;
 	}
+	if (context->backend != VDP_BACKEND_OPENGL) {
+		uint32_t *pixels = realloc(context->pixels, count * FRAMEBUFFER_SIZE);
+		if (!pixels) {
+			return false;
+		}
+		context->pixels = pixels;
+	} else if (count > context->batch->buffer_count) {
+		create_framebuffers(context->batch, context->batch->buffer_count, count);
+	}
+	swap_chain_t *chain = &context->chain;
+	const unsigned int front = chain->front < count ? chain->front : 0;
+	*chain = (swap_chain_t){ .count = count, .mode = mode, .front = front, .back = (front + 1) % count, .presented = chain->presented, .acquired = chain->presented };
+	chain->numbers[front] = chain->presented;
+	return true;
+}
+
+void vdp_set_line(vdp_context_t *context, unsigned int line) {
+	++context->stats.set_calls;
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_LINE, NULL, 1, line);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_LINE, NULL, 1, line);
+		return;
+	}
+	if (line < VDP_FRAMEBUFFER_HEIGHT) {
+		context->line = line;
+	}
+}
+
+static void mark_lines(vdp_context_t *context) {
+	context->dirty_line = context->line < context->dirty_line ? context->line : context->dirty_line;
+	context->raster |= context->line > 0;
+}
+
+// Applies one register from the current line to the end of the frame.
+static void set_lines(vdp_context_t *context, size_t offset, const void *value, size_t size) {
+	for (unsigned int i = context->line; i < VDP_FRAMEBUFFER_HEIGHT; ++i) {
+		memcpy((uint8_t *)&context->state.lines[i] + offset, value, size);
+	}
+	mark_lines(context);
+}
+
+static double now_ms() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (double)time.tv_sec * 1e3 + (double)time.tv_nsec * 1e-6;
+}
+
+// Picks up finished queries, the newest one last so that it wins.
+static void poll_timer(gpu_timer_t *timer) {
+	for (unsigned int i = 0; i < 2; ++i) {
+		const unsigned int slot = (timer->index + i) & 1;
+		GLuint available = GL_FALSE;
+		if (timer->pending[slot]) {
+			glGetQueryObjectuiv(timer->queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+		}
+		if (available) {
+			GLuint64 elapsed;
+			glGetQueryObjectui64v(timer->queries[slot], GL_QUERY_RESULT, &elapsed);
+			timer->ms = (double)elapsed * 1e-6;
+			timer->pending[slot] = false;
+		}
+	}
+}
+
+static void begin_timer(gpu_timer_t *timer) {
+	if (!timer->queries[0]) {
+		glCreateQueries(GL_TIME_ELAPSED, 2, timer->queries);
+	}
+	poll_timer(timer);
+	timer->pending[timer->index] = false;
+	glBeginQuery(GL_TIME_ELAPSED, timer->queries[timer->index]);
+}
+
+static void end_timer(gpu_timer_t *timer) {
+	glEndQuery(GL_TIME_ELAPSED);
+	timer->pending[timer->index] = true;
+	timer->index ^= 1;
+}
+
+// Closes the per frame counters and records the time since the previous frame ended.
+static void end_frame_stats(vdp_context_t *context) {
+	frame_stats_t *stats = &context->stats;
+	const double now = now_ms();
+	if (stats->frame_start > 0.0) {
+		stats->frame_ms[stats->frame_head] = now - stats->frame_start;
+		stats->frame_head = (stats->frame_head + 1) % FRAME_TIME_COUNT;
+		stats->frame_count += stats->frame_count < FRAME_TIME_COUNT;
+	}
+	stats->frame_start = now;
+	++stats->last.frame_count;
+	stats->last.set_calls = stats->set_calls;
+	stats->set_calls = 0;
+	for (unsigned int i = 0; i < VDP_TABLE_COUNT; ++i) {
+		stats->last.uploaded_bytes[i] = context->upload_stats.uploaded_bytes[i] - stats->uploaded_bytes[i];
+		stats->uploaded_bytes[i] = context->upload_stats.uploaded_bytes[i];
+	}
+}
+
+// The next frame starts with whatever was in effect on the last line.
+static void end_frame(vdp_context_t *context) {
+	end_frame_stats(context);
+	if (context->raster) {
+		const vdp_line_t *last = &context->state.lines[VDP_FRAMEBUFFER_HEIGHT - 1];
+		for (unsigned int i = 0; i < VDP_FRAMEBUFFER_HEIGHT - 1; ++i) {
+			context->native_dirty |= context->state.lines[i].hscroll != last->hscroll;
+			context->state.lines[i] = *last;
+		}
+		context->dirty_line = 0;
+		context->raster = false;
+	}
+	context->line = 0;
 }
 
 void vdp_set_mode(vdp_context_t *context, vdp_mode_t mode) {
-	glProgramUniform1ui(context->program, 0, mode == VDP_MODE_INTENSITY);
+	++context->stats.set_calls;
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_MODE, NULL, 1, (uint32_t)mode);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_MODE, NULL, 1, (uint32_t)mode);
+		return;
+	}
+	const uint32_t intensity_mode = mode == VDP_MODE_INTENSITY;
+	set_lines(context, offsetof(vdp_line_t, intensity_mode), &intensity_mode, sizeof (intensity_mode));
 }
 
 void vdp_set_background_color(vdp_context_t *context, unsigned int i) {
-	glProgramUniform1ui(context->program, 1, i);
+	++context->stats.set_calls;
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_BACKGROUND_COLOR, NULL, 1, i);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_BACKGROUND_COLOR, NULL, 1, i);
+		return;
+	}
+	const uint32_t background_color = i;
+	set_lines(context, offsetof(vdp_line_t, background_color), &background_color, sizeof (background_color));
 }
 
 void vdp_set_plane_size(vdp_context_t *context, unsigned int width, unsigned int height) {
-	glProgramUniform2ui(context->program, 2, width, height);
+	++context->stats.set_calls;
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_PLANE_SIZE, NULL, 2, width, height);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_PLANE_SIZE, NULL, 2, width, height);
+		return;
+	}
+	const uint32_t plane_size[2] = {
+		width < 1 ? 1 : width > VDP_PLANE_MAX_WIDTH ? VDP_PLANE_MAX_WIDTH : width,
+		height < 1 ? 1 : height > VDP_PLANE_MAX_HEIGHT ? VDP_PLANE_MAX_HEIGHT : height
+	};
+	set_lines(context, offsetof(vdp_line_t, plane_size), plane_size, sizeof (plane_size));
 }
 
 void vdp_set_window_coord(vdp_context_t *context, int x, int y) {
-	glProgramUniform2i(context->program, 3, x, y);
+	++context->stats.set_calls;
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_WINDOW_COORD, NULL, 2, (uint32_t)x, (uint32_t)y);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_WINDOW_COORD, NULL, 2, (uint32_t)x, (uint32_t)y);
+		return;
+	}
+	const int32_t window[2] = { x, y };
+	set_lines(context, offsetof(vdp_line_t, window), window, sizeof (window));
+}
+
+// Returns the shadow copy of element (x, y) of a table, rows of 2D tables being VDP_PLANE_MAX_WIDTH elements apart.
+static const void *table_data(vdp_context_t *context, vdp_table_t table, unsigned int layer, unsigned int x, unsigned int y, size_t *size) {
+	vdp_state_t *state = &context->state;
+	switch (table) {
+	case VDP_TABLE_COLORS:
+		*size = sizeof (state->color_table[0][0]);
+		return &state->color_table[layer][x];
+	case VDP_TABLE_PATTERNS:
+		*size = sizeof (state->pattern_table[0]);
+		return &state->pattern_table[x];
+	case VDP_TABLE_SPRITES:
+		*size = sizeof (state->sprite_table[0]);
+		return &state->sprite_table[x];
+	case VDP_TABLE_CELLS:
+		*size = sizeof (state->plane_table[0][0][0]);
+		return &state->plane_table[layer][y][x];
+	case VDP_TABLE_HSCROLL:
+		*size = sizeof (state->hscroll_table[0][0]);
+		return &state->hscroll_table[layer][x];
+	case VDP_TABLE_VSCROLL:
+		*size = sizeof (state->vscroll_table[0][0]);
+		return &state->vscroll_table[layer][x];
+	case VDP_TABLE_VRAM:
+		*size = sizeof (context->native.vram[0]);
+		return &context->native.vram[x];
+	case VDP_TABLE_CRAM:
+		*size = sizeof (context->native.cram[0]);
+		return &context->native.cram[x];
+	case VDP_TABLE_VSRAM:
+		*size = sizeof (context->native.vsram[0]);
+		return &context->native.vsram[x];
+	default:
+		*size = sizeof (context->native.registers[0]);
+		return &context->native.registers[x];
+	}
+}
+
+// Grows the range of patterns decoded before the next draw.
+static void mark_patterns(vdp_context_t *context, unsigned int first, unsigned int last) {
+	if (context->decode_first == context->decode_last) {
+		context->decode_first = first;
+		context->decode_last = last;
+		return;
+	}
+	context->decode_first = first < context->decode_first ? first : context->decode_first;
+	context->decode_last = last > context->decode_last ? last : context->decode_last;
+}
+
+// Pixels point to client memory, or are an offset into source when it is a buffer.
+static void submit_upload(vdp_context_t *context, const upload_t *upload, GLint row_length, GLuint source, const void *pixels) {
+	vdp_batch_t *batch = context->batch;
+	if (upload->table >= VDP_TABLE_VRAM) {
+		size_t size;
+		const GLintptr offset = (const uint8_t *)table_data(context, upload->table, 0, upload->x, 0, &size) - (const uint8_t *)&context->native;
+		if (source) {
+			glCopyNamedBufferSubData(source, context->native_buffer, (GLintptr)pixels, offset, (GLsizeiptr)(upload->width * size));
+		} else {
+			glNamedBufferSubData(context->native_buffer, offset, (GLsizeiptr)(upload->width * size), pixels);
+		}
+		return;
+	}
+
+	const GLint x = (GLint)upload->x;
+	const GLint y = (GLint)upload->y;
+	const GLsizei width = (GLsizei)upload->width;
+	const GLsizei height = (GLsizei)upload->height;
+	switch (upload->table) {
+	case VDP_TABLE_COLORS:
+		glTextureSubImage3D(batch->color_tex, 0, x, (GLint)upload->layer, context->layer, width, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+		break;
+	case VDP_TABLE_PATTERNS:
+		glTextureSubImage3D(batch->pattern_tex, 0, 0, x, context->layer, VDP_PATTERN_HEIGHT * (VDP_PATTERN_WIDTH * VDP_PATTERN_BPP) / 32, width, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, pixels);
+		mark_patterns(context, upload->x, upload->x + upload->width);
+		break;
+	case VDP_TABLE_SPRITES:
+		glTextureSubImage2D(batch->sprite_tex, 0, x, context->layer, width, 1, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, pixels);
+		break;
+	case VDP_TABLE_CELLS:
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, row_length);
+		glTextureSubImage3D(batch->plane_tex, 0, x, y, context->layer * VDP_PLANE_COUNT + (GLint)upload->layer, width, height, 1, GL_RED_INTEGER, GL_UNSIGNED_SHORT, pixels);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		break;
+	case VDP_TABLE_HSCROLL:
+		glTextureSubImage2D(batch->hscroll_tex, 0, x, context->layer * 2 + (GLint)upload->layer, width, 1, GL_RED_INTEGER, GL_UNSIGNED_SHORT, pixels);
+		break;
+	default:
+		glTextureSubImage2D(batch->vscroll_tex, 0, x, context->layer * 2 + (GLint)upload->layer, width, 1, GL_RED_INTEGER, GL_UNSIGNED_SHORT, pixels);
+		break;
+	}
+}
+
+static void wait_fence(GLsync *fence) {
+	if (*fence) {
+		while (glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+		}
+		glDeleteSync(*fence);
+		*fence = NULL;
+	}
+}
+
+// Issues every copy recorded so far, sourcing them from the staging buffer.
+static void flush_staging(vdp_context_t *context) {
+	staging_t *staging = &context->staging;
+	if (staging->upload_count) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging->buffer);
+		for (unsigned int i = 0; i < staging->upload_count; ++i) {
+			submit_upload(context, &staging->uploads[i], 0, staging->buffer, (const void *)staging->uploads[i].offset);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		staging->upload_count = 0;
+	}
+}
+
+// Fences the current segment and moves on to the next one once the GPU is done reading it.
+static void advance_staging(vdp_context_t *context) {
+	staging_t *staging = &context->staging;
+	flush_staging(context);
+	if (staging->used) {
+		staging->fences[staging->segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+	staging->segment = (staging->segment + 1) % STAGING_SEGMENT_COUNT;
+	staging->used = 0;
+	wait_fence(&staging->fences[staging->segment]);
+}
+
+static void upload(vdp_context_t *context, vdp_table_t table, unsigned int layer, unsigned int x, unsigned int y, unsigned int width, unsigned int height) {
+	size_t size;
+	const uint8_t *data = table_data(context, table, layer, x, y, &size);
+	upload_t upload = { table, layer, x, y, width, height, 0 };
+	staging_t *staging = &context->staging;
+	if (!staging->active) {
+		submit_upload(context, &upload, VDP_PLANE_MAX_WIDTH, 0, data);
+		return;
+	}
+
+	// rows are padded to the default 4 byte unpack alignment
+	const size_t pitch = (width * size + 3) & ~(size_t)3;
+	if (staging->used + pitch * height > STAGING_SEGMENT_SIZE) {
+		advance_staging(context);
+	}
+	upload.offset = staging->segment * STAGING_SEGMENT_SIZE + staging->used;
+	for (unsigned int j = 0; j < height; ++j) {
+		memcpy(&staging->data[upload.offset + j * pitch], &data[j * VDP_PLANE_MAX_WIDTH * size], width * size);
+	}
+	staging->used += pitch * height;
+	if (staging->upload_count == staging->upload_capacity) {
+		staging->upload_capacity = staging->upload_capacity ? staging->upload_capacity * 2 : 64;
+		staging->uploads = realloc(staging->uploads, staging->upload_capacity * sizeof (upload_t));
+	}
+	staging->uploads[staging->upload_count++] = upload;
+}
+
+// Finds the next run of elements at or after *first that differ from the shadow copy, swallowing short unchanged gaps.
+static bool find_run(const void *shadow, const void *data, size_t size, unsigned int count, unsigned int *first, unsigned int *last) {
+	const uint8_t *a = shadow;
+	const uint8_t *b = data;
+	unsigned int gap = size < RUN_GAP_SIZE ? RUN_GAP_SIZE / (unsigned int)size : 1;
+	unsigned int i = *first;
+	while (i < count && !memcmp(&a[i * size], &b[i * size], size)) {
+		++i;
+	}
+	if (i == count) {
+		return false;
+	}
+	*first = i;
+	*last = i + 1;
+	for (++i; i < count && i - *last < gap; ++i) {
+		if (memcmp(&a[i * size], &b[i * size], size)) {
+			*last = i + 1;
+		}
+	}
+	return true;
+}
+
+static void update_table(vdp_context_t *context, vdp_table_t table, unsigned int layer, void *shadow, const void *data, size_t size, unsigned int start, unsigned int count) {
+	uint8_t *target = (uint8_t *)shadow + start * size;
+	const bool native = table >= VDP_TABLE_VRAM;
+	const bool stale = context->shadow_stale && !native && table != VDP_TABLE_COLORS;
+	context->upload_stats.submitted_bytes[table] += count * size;
+	if (!memcmp(target, data, count * size) && !stale) {
+		return;
+	}
+	context->native_dirty |= native;
+	if (context->backend != VDP_BACKEND_OPENGL) {
+		memcpy(target, data, count * size);
+		return;
+	}
+
+	// tables resolved on the GPU from native memory no longer match their shadow copy
+	if (stale) {
+		memcpy(target, data, count * size);
+		upload(context, table, layer, start, 0, count, 1);
+		context->upload_stats.uploaded_bytes[table] += count * size;
+		return;
+	}
+
+	unsigned int first = 0;
+	unsigned int last;
+	while (find_run((uint8_t *)shadow + start * size, data, size, count, &first, &last)) {
+		memcpy((uint8_t *)shadow + (start + first) * size, (const uint8_t *)data + first * size, (last - first) * size);
+		upload(context, table, layer, start + first, 0, last - first, 1);
+		context->upload_stats.uploaded_bytes[table] += (last - first) * size;
+		first = last;
+	}
+}
+
+// Palette changes past the first line go to a bank of their own so that earlier lines keep theirs.
+static uint32_t claim_palette(vdp_context_t *context) {
+	vdp_line_t *lines = context->state.lines;
+	uint32_t palette = lines[context->line].palette;
+	bool used[VDP_PALETTE_COUNT] = { false };
+	for (unsigned int i = 0; i < context->line; ++i) {
+		used[lines[i].palette] = true;
+	}
+	if (used[palette]) {
+		uint32_t bank = 0;
+		while (bank < VDP_PALETTE_COUNT && used[bank]) {
+			++bank;
+		}
+		// out of banks, the change leaks into the lines above
+		if (bank == VDP_PALETTE_COUNT) {
+			return palette;
+		}
+		update_table(context, VDP_TABLE_COLORS, bank, context->state.color_table[bank], context->state.color_table[palette], sizeof (context->state.color_table[0][0]), 0, VDP_COLOR_COUNT * 4);
+		palette = bank;
+	}
+	set_lines(context, offsetof(vdp_line_t, palette), &palette, sizeof (palette));
+	return palette;
+}
+
+static void set_colors(vdp_context_t *context, unsigned int start, unsigned int count, const vdp_color_t *data) {
+	if (start > VDP_COLOR_COUNT * 4 || count > VDP_COLOR_COUNT * 4 - start) {
+		return;
+	}
+	const uint32_t palette = claim_palette(context);
+	update_table(context, VDP_TABLE_COLORS, palette, context->state.color_table[palette], data, sizeof (context->state.color_table[0][0]), start, count);
 }
 
 void vdp_set_colors(vdp_context_t *context, unsigned int start, unsigned int count, const vdp_color_t *data) {
-	glTextureSubImage1D(context->color_tex, 0, (GLint)start, (GLsizei)count, GL_RGBA, GL_UNSIGNED_BYTE, data);
+	++context->stats.set_calls;
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_COLORS, data, 2, start, count);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_COLORS, data, 2, start, count);
+		return;
+	}
+	set_colors(context, start, count, data);
 }
 
 void vdp_set_colors_sh(vdp_context_t *context, unsigned int start, unsigned int count, const vdp_color_t *data) {
+	++context->stats.set_calls;
+	// clamped before recording so that traces and queues replay exactly what was applied
+	if (start > VDP_COLOR_COUNT) {
+		return;
+	}
+	count = count < VDP_COLOR_COUNT - start ? count : VDP_COLOR_COUNT - start;
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_COLORS_SH, data, 2, start, count);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_COLORS_SH, data, 2, start, count);
+		return;
+	}
 	vdp_color_t shadow[64];
 	vdp_color_t highlight[64];
-	for (unsigned int i = 0; i < count && i < 64; ++i) {
+	memcpy(shadow, data, count * sizeof (vdp_color_t));
+	memcpy(highlight, data, count * sizeof (vdp_color_t));
+	for (unsigned int i = 0; i < count; ++i) {
 		shadow[i].r = data[i].r / 2;
 		shadow[i].g = data[i].g / 2;
 		shadow[i].b = data[i].b / 2;
@@ -209,57 +1246,813 @@ void vdp_set_colors_sh(vdp_context_t *context, unsigned int start, unsigned int
 		highlight[i].g = data[i].g / 2 + 128;
 		highlight[i].b = data[i].b / 2 + 128;
 	}
-	vdp_set_colors(context, start + 0, count, shadow);
-	vdp_set_colors(context, start + 64, count, data);
-	vdp_set_colors(context, start + 128, count, highlight);
+	set_colors(context, start + 0, count, shadow);
+	set_colors(context, start + 64, count, data);
+	set_colors(context, start + 128, count, highlight);
 }
 
 void vdp_set_patterns(vdp_context_t *context, unsigned int start, unsigned int count, const uint32_t *data) {
-	glTextureSubImage3D(context->pattern_tex, 0, 0, 0, (GLint)start, (VDP_PATTERN_WIDTH * VDP_PATTERN_BPP) / 32, VDP_PATTERN_HEIGHT, (GLsizei)count, GL_RED_INTEGER, GL_UNSIGNED_INT, data);
+	++context->stats.set_calls;
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_PATTERNS, data, 2, start, count);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_PATTERNS, data, 2, start, count);
+		return;
+	}
+	if (start > VDP_PATTERN_COUNT || count > VDP_PATTERN_COUNT - start) {
+		return;
+	}
+	update_table(context, VDP_TABLE_PATTERNS, 0, context->state.pattern_table, data, sizeof (context->state.pattern_table[0]), start, count);
 }
 
 void vdp_set_sprites(vdp_context_t *context, unsigned int start, unsigned int count, const vdp_sprite_t *data) {
-	glTextureSubImage1D(context->sprite_tex, 0, (GLint)start, (GLsizei)count, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, data);
+	++context->stats.set_calls;
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_SPRITES, data, 2, start, count);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_SPRITES, data, 2, start, count);
+		return;
+	}
+	if (start > VDP_SPRITE_COUNT || count > VDP_SPRITE_COUNT - start) {
+		return;
+	}
+	update_table(context, VDP_TABLE_SPRITES, 0, context->state.sprite_table, data, sizeof (context->state.sprite_table[0]), start, count);
 }
 
 void vdp_set_cells(vdp_context_t *context, vdp_plane_t plane, unsigned int x, unsigned int y, unsigned int width, unsigned int height, const vdp_cell_t *data) {
-	glTextureSubImage3D(context->plane_tex, 0, (GLint)x, (GLint)y, (GLint)plane, (GLsizei)width, (GLsizei)height, 1, GL_RED_INTEGER, GL_UNSIGNED_SHORT, data);
+	++context->stats.set_calls;
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_CELLS, data, 5, (uint32_t)plane, x, y, width, height);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_CELLS, data, 5, (uint32_t)plane, x, y, width, height);
+		return;
+	}
+	if ((unsigned int)plane >= VDP_PLANE_COUNT || x > VDP_PLANE_MAX_WIDTH || width > VDP_PLANE_MAX_WIDTH - x || y > VDP_PLANE_MAX_HEIGHT || height > VDP_PLANE_MAX_HEIGHT - y) {
+		return;
+	}
+	const size_t size = sizeof (context->state.plane_table[0][0][0]);
+	context->upload_stats.submitted_bytes[VDP_TABLE_CELLS] += width * height * size;
+	if (context->backend != VDP_BACKEND_OPENGL) {
+		for (unsigned int j = 0; j < height; ++j) {
+			memcpy(&context->state.plane_table[plane][y + j][x], &data[j * width], width * size);
+		}
+		return;
+	}
+	if (context->shadow_stale) {
+		for (unsigned int j = 0; j < height; ++j) {
+			memcpy(&context->state.plane_table[plane][y + j][x], &data[j * width], width * size);
+		}
+		upload(context, VDP_TABLE_CELLS, plane, x, y, width, height);
+		context->upload_stats.uploaded_bytes[VDP_TABLE_CELLS] += width * height * size;
+		return;
+	}
+
+	// consecutive changed rows are grouped into one rectangle spanning their changed columns
+	unsigned int band_top = 0;
+	unsigned int band_left = width;
+	unsigned int band_right = 0;
+	for (unsigned int j = 0; j <= height; ++j) {
+		unsigned int first = 0;
+		unsigned int last = 0;
+		bool changed = j < height && find_run(&context->state.plane_table[plane][y + j][x], &data[j * width], size, width, &first, &last);
+		if (changed) {
+			unsigned int next = last;
+			while (find_run(&context->state.plane_table[plane][y + j][x], &data[j * width], size, width, &next, &last)) {
+				next = last;
+			}
+			memcpy(&context->state.plane_table[plane][y + j][x + first], &data[j * width + first], (last - first) * size);
+			if (band_left > band_right) {
+				band_top = j;
+			}
+			band_left = first < band_left ? first : band_left;
+			band_right = last > band_right ? last : band_right;
+		} else if (band_left < band_right) {
+			upload(context, VDP_TABLE_CELLS, plane, x + band_left, y + band_top, band_right - band_left, j - band_top);
+			context->upload_stats.uploaded_bytes[VDP_TABLE_CELLS] += (band_right - band_left) * (j - band_top) * size;
+			band_left = width;
+			band_right = 0;
+		}
+	}
 }
 
 void vdp_set_hscroll(vdp_context_t *context, vdp_plane_t plane, unsigned int start, unsigned int count, const uint16_t *data) {
-	glTextureSubImage2D(context->hscroll_tex, 0, (GLint)start, (GLint)plane, (GLsizei)count, 1, GL_RED_INTEGER, GL_UNSIGNED_SHORT, data);
+	++context->stats.set_calls;
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_HSCROLL, data, 3, (uint32_t)plane, start, count);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_HSCROLL, data, 3, (uint32_t)plane, start, count);
+		return;
+	}
+	if (plane > VDP_PLANE_B || start > VDP_HSCROLL_COUNT || count > VDP_HSCROLL_COUNT - start) {
+		return;
+	}
+	update_table(context, VDP_TABLE_HSCROLL, plane, context->state.hscroll_table[plane], data, sizeof (context->state.hscroll_table[0][0]), start, count);
 }
 
 void vdp_set_vscroll(vdp_context_t *context, vdp_plane_t plane, unsigned int start, unsigned int count, const uint16_t *data) {
-	glTextureSubImage2D(context->vscroll_tex, 0, (GLint)start, (GLint)plane, (GLsizei)count, 1, GL_RED_INTEGER, GL_UNSIGNED_SHORT, data);
+	++context->stats.set_calls;
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_VSCROLL, data, 3, (uint32_t)plane, start, count);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_VSCROLL, data, 3, (uint32_t)plane, start, count);
+		return;
+	}
+	if (plane > VDP_PLANE_B || start > VDP_VSCROLL_COUNT || count > VDP_VSCROLL_COUNT - start) {
+		return;
+	}
+	update_table(context, VDP_TABLE_VSCROLL, plane, context->state.vscroll_table[plane], data, sizeof (context->state.vscroll_table[0][0]), start, count);
 }
 
-void vdp_render(vdp_context_t *context) {
-	glUseProgram(context->program);
-	glBindVertexArray(context->vao);
-	glBindFramebuffer(GL_FRAMEBUFFER, context->framebuffer_fbo);
-	glBindTextureUnit(0, context->color_tex);
-	glBindTextureUnit(1, context->pattern_tex);
-	glBindTextureUnit(2, context->sprite_tex);
-	glBindTextureUnit(3, context->plane_tex);
-	glBindTextureUnit(4, context->hscroll_tex);
-	glBindTextureUnit(5, context->vscroll_tex);
-
-	glViewport(0, 0, VDP_FRAMEBUFFER_WIDTH, VDP_FRAMEBUFFER_HEIGHT);
-	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
-	glClear(GL_COLOR_BUFFER_BIT);
-	glDrawArrays(GL_POINTS, 0, 1);
+void vdp_set_vram(vdp_context_t *context, unsigned int start, unsigned int count, const uint8_t *data) {
+	++context->stats.set_calls;
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_VRAM, data, 2, start, count);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_VRAM, data, 2, start, count);
+		return;
+	}
+	if (start > VDP_VRAM_SIZE || count > VDP_VRAM_SIZE - start) {
+		return;
+	}
+	update_table(context, VDP_TABLE_VRAM, 0, context->native.vram, data, sizeof (context->native.vram[0]), start, count);
+}
 
-	glBindVertexArray(0);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+void vdp_set_cram(vdp_context_t *context, unsigned int start, unsigned int count, const uint16_t *data) {
+	++context->stats.set_calls;
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_CRAM, data, 2, start, count);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_CRAM, data, 2, start, count);
+		return;
+	}
+	if (start > VDP_CRAM_COUNT || count > VDP_CRAM_COUNT - start) {
+		return;
+	}
+	// colors are decoded here rather than in vdp.unpack.glsl, they have to follow the palette timeline
+	uint32_t colors[VDP_COLOR_COUNT * 4];
+	context->upload_stats.submitted_bytes[VDP_TABLE_CRAM] += count * sizeof (context->native.cram[0]);
+	memcpy(&context->native.cram[start], data, count * sizeof (context->native.cram[0]));
+	vdp_resolve_cram(colors, context->native.cram, start, count);
+	set_colors(context, start + 0, count, (const vdp_color_t *)&colors[start + 0]);
+	set_colors(context, start + 64, count, (const vdp_color_t *)&colors[start + 64]);
+	set_colors(context, start + 128, count, (const vdp_color_t *)&colors[start + 128]);
+}
+
+void vdp_set_vsram(vdp_context_t *context, unsigned int start, unsigned int count, const uint16_t *data) {
+	++context->stats.set_calls;
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_VSRAM, data, 2, start, count);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_VSRAM, data, 2, start, count);
+		return;
+	}
+	if (start > VDP_VSRAM_COUNT || count > VDP_VSRAM_COUNT - start) {
+		return;
+	}
+	update_table(context, VDP_TABLE_VSRAM, 0, context->native.vsram, data, sizeof (context->native.vsram[0]), start, count);
+}
+
+void vdp_set_registers(vdp_context_t *context, unsigned int start, unsigned int count, const uint8_t *data) {
+	++context->stats.set_calls;
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_REGISTERS, data, 2, start, count);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_REGISTERS, data, 2, start, count);
+		return;
+	}
+	if (start > VDP_REGISTER_COUNT || count > VDP_REGISTER_COUNT - start) {
+		return;
+	}
+	update_table(context, VDP_TABLE_REGISTERS, 0, context->native.registers, data, sizeof (context->native.registers[0]), start, count);
+	vdp_line_t line;
+	vdp_resolve_registers(&line, &context->native);
+	for (unsigned int i = context->line; i < VDP_FRAMEBUFFER_HEIGHT; ++i) {
+		context->native_dirty |= context->state.lines[i].hscroll != line.hscroll;
+		line.palette = context->state.lines[i].palette;
+		context->state.lines[i] = line;
+	}
+	mark_lines(context);
+}
+
+void vdp_get_upload_stats(vdp_context_t *context, vdp_upload_stats_t *stats) {
+	*stats = context->upload_stats;
+}
+
+void vdp_reset_upload_stats(vdp_context_t *context) {
+	memset(&context->upload_stats, 0, sizeof (vdp_upload_stats_t));
+	memset(context->stats.uploaded_bytes, 0, sizeof (context->stats.uploaded_bytes));
+}
+
+static int compare_ms(const void *a, const void *b) {
+	const double x = *(const double *)a;
+	const double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// GPU times lag a frame or two behind, batch renders report the time of the whole batch.
+void vdp_get_stats(vdp_context_t *context, vdp_stats_t *stats) {
+	frame_stats_t *frame = &context->stats;
+	*stats = frame->last;
+	if (context->backend == VDP_BACKEND_OPENGL) {
+		gpu_timer_t *render_timer = context->batch_rendered ? &context->batch->render_timer : &context->render_timer;
+		poll_timer(render_timer);
+		poll_timer(&context->blit_timer);
+		stats->render_ms = render_timer->ms;
+		stats->blit_ms = context->blit_timer.ms;
+	}
+	if (frame->frame_count) {
+		double sorted[FRAME_TIME_COUNT];
+		double sum = 0.0;
+		memcpy(sorted, frame->frame_ms, frame->frame_count * sizeof (double));
+		qsort(sorted, frame->frame_count, sizeof (double), compare_ms);
+		for (unsigned int i = 0; i < frame->frame_count; ++i) {
+			sum += sorted[i];
+		}
+		stats->frame_ms_min = sorted[0];
+		stats->frame_ms_avg = sum / frame->frame_count;
+		stats->frame_ms_p99 = sorted[(frame->frame_count * 99 - 1) / 100];
+	}
+}
+
+bool vdp_start_trace(vdp_context_t *context, const char *path) {
+	vdp_destroy_trace(context->trace);
+	context->trace = vdp_create_trace(path);
+	return context->trace != NULL;
+}
+
+void vdp_stop_trace(vdp_context_t *context) {
+	vdp_destroy_trace(context->trace);
+	context->trace = NULL;
+}
+
+// Writes out captured frames in order, waiting for the GPU only while more than pending are in flight.
+// Returns false once the writer has failed.
+static bool flush_capture(vdp_context_t *context, unsigned int pending) {
+	bool written = true;
+	while (context->capture_count) {
+		readback_t *capture = &context->captures[context->capture_head];
+		const GLuint64 timeout = context->capture_count > pending ? GL_TIMEOUT_IGNORED : 0;
+		GLenum status = glClientWaitSync(capture->fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+			break;
+		}
+		glDeleteSync(capture->fence);
+		capture->fence = NULL;
+		written &= vdp_capture_frame(context->capture, capture->data);
+		context->capture_head = (context->capture_head + 1) % READBACK_COUNT;
+		--context->capture_count;
+	}
+	return written;
+}
+
+// Converts the frame just rendered to YUV on the GPU and reads back a third of what vdp_read_async would.
+// Frames are never dropped, a slow writer eventually stalls rendering instead. A failed write stops the capture.
+static void capture_frame(vdp_context_t *context) {
+	if (!context->capture) {
+		return;
+	}
+	if (context->backend != VDP_BACKEND_OPENGL) {
+		readback_t *capture = &context->captures[0];
+		if (!capture->data) {
+			capture->data = malloc(VDP_CAPTURE_FRAME_SIZE);
+		}
+		vdp_convert_yuv(frame_pixels(context, context->chain.back), capture->data);
+		if (!vdp_capture_frame(context->capture, capture->data)) {
+			vdp_stop_capture(context);
+		}
+		return;
+	}
+
+	if (!flush_capture(context, READBACK_COUNT - 1)) {
+		vdp_stop_capture(context);
+		return;
+	}
+	readback_t *capture = &context->captures[(context->capture_head + context->capture_count) % READBACK_COUNT];
+	if (!capture->buffer) {
+		const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glCreateBuffers(1, &capture->buffer);
+		glNamedBufferStorage(capture->buffer, VDP_CAPTURE_FRAME_SIZE, NULL, flags | GL_CLIENT_STORAGE_BIT);
+		capture->data = glMapNamedBufferRange(capture->buffer, 0, VDP_CAPTURE_FRAME_SIZE, flags);
+	}
+	glUseProgram(context->batch->device->yuv_program);
+	glBindTextureUnit(0, context->batch->framebuffer_tex[context->chain.back]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, capture->buffer);
+	glUniform1i(0, context->layer);
+	glDispatchCompute((VDP_FRAMEBUFFER_WIDTH / 8 + YUV_GROUP_SIZE - 1) / YUV_GROUP_SIZE, (VDP_FRAMEBUFFER_HEIGHT / 2 + YUV_GROUP_SIZE - 1) / YUV_GROUP_SIZE, 1);
+	glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
 	glBindTextureUnit(0, 0);
+	glUseProgram(0);
+	capture->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	++context->capture_count;
+}
+
+bool vdp_start_capture(vdp_context_t *context, const char *path) {
+	vdp_stop_capture(context);
+	if (context->queue) {
+		// never renders, capture on the context that vdp_run_queue drives instead
+		return false;
+	}
+	if (context->format != VDP_FORMAT_RGBA8) {
+		fprintf(stderr, "Captures require the RGBA8 output format.\n");
+		return false;
+	}
+	vdp_device_t *device = context->batch ? context->batch->device : NULL;
+	if (device && !device->yuv_program) {
+		GLenum types[] = { GL_COMPUTE_SHADER };
+		const GLchar *sources[] = { vdp_yuv_glsl };
+		device->yuv_program = create_program_from_source(types, sources, 1, NULL);
+		if (!device->yuv_program) {
+			return false;
+		}
+	}
+	context->capture = vdp_create_capture(path);
+	return context->capture != NULL;
+}
+
+void vdp_stop_capture(vdp_context_t *context) {
+	if (!context->capture) {
+		return;
+	}
+	if (context->backend == VDP_BACKEND_OPENGL) {
+		flush_capture(context, 0);
+	}
+	for (unsigned int i = 0; i < READBACK_COUNT; ++i) {
+		if (context->backend == VDP_BACKEND_OPENGL) {
+			glDeleteBuffers(1, &context->captures[i].buffer);
+		} else {
+			free(context->captures[i].data);
+		}
+		context->captures[i] = (readback_t){ 0 };
+	}
+	context->capture_head = 0;
+	vdp_destroy_capture(context->capture);
+	context->capture = NULL;
+}
+
+void vdp_begin_update(vdp_context_t *context) {
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_BEGIN_UPDATE, NULL, 0);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_BEGIN_UPDATE, NULL, 0);
+		return;
+	}
+	staging_t *staging = &context->staging;
+	if (context->backend != VDP_BACKEND_OPENGL || staging->active) {
+		return;
+	}
+	if (!staging->buffer) {
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glCreateBuffers(1, &staging->buffer);
+		glNamedBufferStorage(staging->buffer, STAGING_SEGMENT_COUNT * STAGING_SEGMENT_SIZE, NULL, flags);
+		staging->data = glMapNamedBufferRange(staging->buffer, 0, STAGING_SEGMENT_COUNT * STAGING_SEGMENT_SIZE, flags);
+	}
+	advance_staging(context);
+	staging->active = true;
+}
+
+void vdp_commit_update(vdp_context_t *context) {
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_COMMIT_UPDATE, NULL, 0);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_COMMIT_UPDATE, NULL, 0);
+		return;
+	}
+	staging_t *staging = &context->staging;
+	if (!staging->active) {
+		return;
+	}
+	flush_staging(context);
+	if (staging->used) {
+		staging->fences[staging->segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		staging->used = 0;
+	}
+	staging->active = false;
+}
+
+// Rebuilds every table but the colors from native memory, one invocation per pattern strip.
+static void flush_native(vdp_context_t *context) {
+	if (!context->native_dirty) {
+		return;
+	}
+	if (context->backend != VDP_BACKEND_OPENGL) {
+		vdp_resolve_tables(&context->state, &context->native);
+		context->native_dirty = false;
+		return;
+	}
+
+	vdp_batch_t *batch = context->batch;
+	glUseProgram(batch->device->unpack_program);
+	glProgramUniform1i(batch->device->unpack_program, 0, context->layer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, context->native_buffer);
+	glBindImageTexture(1, batch->pattern_tex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R32UI);
+	glBindImageTexture(2, batch->sprite_tex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA16UI);
+	glBindImageTexture(3, batch->plane_tex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R16UI);
+	glBindImageTexture(4, batch->hscroll_tex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R16UI);
+	glBindImageTexture(5, batch->vscroll_tex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R16UI);
+	glBindTextureUnit(6, batch->register_tex);
+
+	glDispatchCompute(VDP_PATTERN_COUNT * VDP_PATTERN_HEIGHT / UNPACK_GROUP_SIZE, 1, 1);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+	for (GLuint i = 1; i < 6; ++i) {
+		glBindImageTexture(i, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32UI);
+	}
+	glBindTextureUnit(6, 0);
+	context->native_dirty = false;
+	context->shadow_stale = true;
+	mark_patterns(context, 0, VDP_PATTERN_COUNT);
+}
+
+// Expands the patterns touched since the last draw to one byte per pixel, a strip per invocation.
+static void decode_patterns(vdp_context_t *context) {
+	if (context->decode_first == context->decode_last) {
+		return;
+	}
+	vdp_batch_t *batch = context->batch;
+	const GLuint first = context->decode_first * VDP_PATTERN_HEIGHT;
+	const GLuint count = (context->decode_last - context->decode_first) * VDP_PATTERN_HEIGHT;
+	glUseProgram(batch->device->decode_program);
+	glProgramUniform1i(batch->device->decode_program, 0, context->layer);
+	glProgramUniform1ui(batch->device->decode_program, 1, first);
+	glProgramUniform1ui(batch->device->decode_program, 2, count);
+	glBindTextureUnit(1, batch->pattern_tex);
+	glBindImageTexture(0, batch->pattern_index_tex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R8UI);
+
+	glDispatchCompute((count + DECODE_GROUP_SIZE - 1) / DECODE_GROUP_SIZE, 1, 1);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+	glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R8UI);
 	glBindTextureUnit(1, 0);
+	context->decode_first = 0;
+	context->decode_last = 0;
+}
+
+// Lists the sprites of every line once, so that fragments only walk the sprites of their own line.
+static void build_sprite_lines(vdp_batch_t *batch, GLint first, GLsizei count) {
+	glUseProgram(batch->device->sprites_program);
+	glProgramUniform1i(batch->device->sprites_program, 0, first);
+	glBindTextureUnit(2, batch->sprite_tex);
+	glBindImageTexture(0, batch->sprite_line_tex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R16UI);
+
+	glDispatchCompute((VDP_FRAMEBUFFER_HEIGHT + SPRITES_GROUP_SIZE - 1) / SPRITES_GROUP_SIZE, (GLuint)count, 1);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+	glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R16UI);
 	glBindTextureUnit(2, 0);
-	glBindTextureUnit(3, 0);
-	glBindTextureUnit(4, 0);
-	glBindTextureUnit(5, 0);
+}
+
+static void bind_tables(vdp_batch_t *batch) {
+	glBindTextureUnit(0, batch->color_tex);
+	glBindTextureUnit(1, batch->pattern_index_tex);
+	glBindTextureUnit(2, batch->sprite_tex);
+	glBindTextureUnit(3, batch->plane_tex);
+	glBindTextureUnit(4, batch->hscroll_tex);
+	glBindTextureUnit(5, batch->vscroll_tex);
+	glBindTextureUnit(6, batch->register_tex);
+	glBindTextureUnit(7, batch->sprite_line_tex);
+}
+
+static void unbind_tables() {
+	for (GLuint i = 0; i < 8; ++i) {
+		glBindTextureUnit(i, 0);
+	}
+}
+
+static int plane_size_variant(const uint32_t plane_size[2]) {
+	int variant = 0;
+	for (unsigned int i = 0; i < 2; ++i) {
+		const uint32_t size = plane_size[i];
+		if (size != 32 && size != 64 && size != 128) {
+			return -1;
+		}
+		variant = variant * 3 + (size == 32 ? 0 : size == 64 ? 1 : 2);
+	}
+	return variant;
+}
+
+// Picks the variant baking in every register that stays the same on all lines of the instances drawn.
+static GLuint select_program(vdp_batch_t *batch, GLint first, GLsizei count) {
+	program_variant_t variant = { 0, 0, 0, batch->format };
+	for (GLsizei i = 0; i < count; ++i) {
+		const vdp_line_t *lines = batch->contexts[first + i]->state.lines;
+		for (unsigned int y = 0; y < VDP_FRAMEBUFFER_HEIGHT; ++y) {
+			const program_variant_t line = {
+				lines[y].intensity_mode != 0,
+				lines[y].window[0] || lines[y].window[1] ? -1 : 0,
+				plane_size_variant(lines[y].plane_size),
+				batch->format
+			};
+			if (i == 0 && y == 0) {
+				variant = line;
+			}
+			variant.intensity_mode = variant.intensity_mode == line.intensity_mode ? variant.intensity_mode : -1;
+			variant.window = variant.window == line.window ? variant.window : -1;
+			variant.plane_size = variant.plane_size == line.plane_size ? variant.plane_size : -1;
+		}
+	}
+	GLuint *programs = batch->device->programs[batch->compute];
+	const unsigned int index = variant_index(&variant);
+	if (!programs[index]) {
+		programs[index] = create_render_program(batch->compute, &variant);
+		if (!programs[index]) {
+			programs[index] = programs[batch->format];
+		}
+	}
+	return programs[index];
+}
+
+// Renders instances [first, first + count) into their framebuffer layers, fbo covers those layers. When a viewport
+// is given they are drawn straight into that viewport of fbo instead. The compute program writes the given swap buffer.
+static void draw(vdp_batch_t *batch, unsigned int buffer, GLuint fbo, const GLint viewport[4], GLint first, GLsizei count) {
+	const GLuint program = select_program(batch, first, count);
+	bind_tables(batch);
+	if (batch->compute) {
+		glUseProgram(program);
+		glProgramUniform1i(program, 0, first);
+		glBindImageTexture(0, batch->framebuffer_tex[buffer], 0, GL_TRUE, 0, GL_WRITE_ONLY, output_formats[batch->format].internal_format);
+		glDispatchCompute(1, VDP_FRAMEBUFFER_HEIGHT, (GLuint)count);
+		glMemoryBarrier(GL_FRAMEBUFFER_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+		glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+		unbind_tables();
+		return;
+	}
+
+	glUseProgram(program);
+	glBindVertexArray(batch->device->vao);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	if (viewport) {
+		glProgramUniform4iv(program, 0, 1, viewport);
+		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	} else {
+		glProgramUniform4i(program, 0, 0, 0, VDP_FRAMEBUFFER_WIDTH, VDP_FRAMEBUFFER_HEIGHT);
+		glViewport(0, 0, VDP_FRAMEBUFFER_WIDTH, VDP_FRAMEBUFFER_HEIGHT);
+	}
+	glDrawArrays(GL_POINTS, first, count);
+
+	glBindVertexArray(0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	unbind_tables();
+}
+
+static void render(vdp_context_t *context, GLuint fbo, const GLint viewport[4]) {
+	if (context->backend != VDP_BACKEND_OPENGL) {
+		const double start = now_ms();
+		flush_native(context);
+		vdp_build_sprite_lines(&context->state);
+		if (context->backend == VDP_BACKEND_REFERENCE) {
+			vdp_render_reference(&context->state, context->format, frame_pixels(context, context->chain.back));
+		} else {
+			vdp_render_software(context->software, &context->state, context->format, frame_pixels(context, context->chain.back));
+		}
+		context->stats.last.render_ms = now_ms() - start;
+		capture_frame(context);
+		end_frame(context);
+		return;
+	}
+	begin_timer(&context->render_timer);
+	flush_staging(context);
+	flush_registers(context);
+	flush_native(context);
+	decode_patterns(context);
+	build_sprite_lines(context->batch, context->layer, 1);
+	const unsigned int back = context->chain.back;
+	if (viewport && !context->batch->compute) {
+		draw(context->batch, back, fbo, viewport, context->layer, 1);
+		if (context->capture) {
+			// captures always come from the framebuffer
+			draw(context->batch, back, context->framebuffer_fbo[back], NULL, context->layer, 1);
+		}
+	} else {
+		draw(context->batch, back, context->framebuffer_fbo[back], NULL, context->layer, 1);
+	}
+	if (viewport && context->batch->compute && context->format == VDP_FORMAT_RGBA8) {
+		glBlitNamedFramebuffer(context->framebuffer_fbo[back], fbo, 0, 0, VDP_FRAMEBUFFER_WIDTH, VDP_FRAMEBUFFER_HEIGHT, viewport[0], viewport[1], viewport[0] + viewport[2], viewport[1] + viewport[3], GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	}
+	end_timer(&context->render_timer);
+	capture_frame(context);
+	context->batch_rendered = false;
+	end_frame(context);
+}
+
+void vdp_render(vdp_context_t *context) {
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_RENDER, NULL, 0);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_RENDER, NULL, 0);
+		return;
+	}
+	render(context, 0, NULL);
+}
+
+// Shades every pixel of the target once, without going through the framebuffer vdp_blit and vdp_read_pixels use.
+// The compute backend has no such path and blits its framebuffer instead, CPU backends draw nothing.
+// RGB565 and palette indices need an unsigned integer target.
+void vdp_render_to(vdp_context_t *context, unsigned int fbo, unsigned int x, unsigned int y, unsigned int width, unsigned int height) {
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_RENDER_TO, NULL, 5, fbo, x, y, width, height);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_RENDER_TO, NULL, 5, fbo, x, y, width, height);
+		return;
+	}
+	const GLint viewport[4] = { (GLint)x, (GLint)y, (GLint)width, (GLint)height };
+	render(context, fbo, width && height ? viewport : NULL);
+}
+
+// FIFO never drops a frame: when the consumer is behind and the queue is full, nothing is presented, the frame
+// stays in the back buffer and false is returned until vdp_get_frame makes room. Mailbox always presents,
+// replacing the oldest queued frame when the queue is full.
+bool vdp_present(vdp_context_t *context) {
+	swap_chain_t *chain = &context->chain;
+	if (chain->count == 1) {
+		chain->numbers[chain->back] = ++chain->presented;
+		return true;
+	}
+	// with two buffers there is no room for a queue, the front buffer is the only pending frame
+	const bool full = chain->count == 2 ? chain->numbers[chain->front] != chain->acquired : chain->queued == chain->count - 2;
+	if (full && chain->mode == VDP_PRESENT_FIFO) {
+		return false;
+	}
+	chain->numbers[chain->back] = ++chain->presented;
+	if (chain->count == 2) {
+		const unsigned int front = chain->front;
+		chain->front = chain->back;
+		chain->back = front;
+		return true;
+	}
+	if (full) {
+		const unsigned int dropped = chain->queue[0];
+		memmove(chain->queue, chain->queue + 1, (chain->queued - 1) * sizeof (unsigned int));
+		chain->queue[chain->queued - 1] = chain->back;
+		chain->back = dropped;
+		return true;
+	}
+	chain->queue[chain->queued++] = chain->back;
+	for (unsigned int i = 0; i < chain->count; ++i) {
+		bool used = i == chain->front;
+		for (unsigned int j = 0; j < chain->queued; ++j) {
+			used |= i == chain->queue[j];
+		}
+		if (!used) {
+			chain->back = i;
+			break;
+		}
+	}
+	return true;
+}
+
+// FIFO hands out queued frames oldest first, mailbox skips to the newest. Returns false when no frame was presented
+// since the last call, frame still describes the front buffer then.
+bool vdp_get_frame(vdp_context_t *context, vdp_frame_t *frame) {
+	swap_chain_t *chain = &context->chain;
+	if (chain->queued && chain->mode == VDP_PRESENT_MAILBOX) {
+		chain->front = chain->queue[chain->queued - 1];
+		chain->queued = 0;
+	} else if (chain->queued) {
+		chain->front = chain->queue[0];
+		memmove(chain->queue, chain->queue + 1, (chain->queued - 1) * sizeof (unsigned int));
+		--chain->queued;
+	}
+	if (frame) {
+		frame->texture = context->backend == VDP_BACKEND_OPENGL ? context->batch->framebuffer_tex[chain->front] : 0;
+		frame->layer = context->backend == VDP_BACKEND_OPENGL ? (unsigned int)context->layer : 0;
+		frame->number = chain->numbers[chain->front];
+	}
+	const bool fresh = chain->numbers[chain->front] != chain->acquired;
+	chain->acquired = chain->numbers[chain->front];
+	return fresh;
+}
+
+void vdp_render_batch(vdp_batch_t *batch) {
+	begin_timer(&batch->render_timer);
+	for (unsigned int i = 0; i < batch->count; ++i) {
+		flush_staging(batch->contexts[i]);
+		flush_registers(batch->contexts[i]);
+		flush_native(batch->contexts[i]);
+		decode_patterns(batch->contexts[i]);
+	}
+	build_sprite_lines(batch, 0, (GLsizei)batch->count);
+	// instances share a draw as long as they render into the same swap buffer, which they do unless presented apart
+	for (unsigned int first = 0, i = 1; i <= batch->count; ++i) {
+		const unsigned int back = batch->contexts[first]->chain.back;
+		if (i == batch->count || batch->contexts[i]->chain.back != back) {
+			draw(batch, back, batch->framebuffer_fbo[back], NULL, (GLint)first, (GLsizei)(i - first));
+			first = i;
+		}
+	}
+	end_timer(&batch->render_timer);
+	for (unsigned int i = 0; i < batch->count; ++i) {
+		batch->contexts[i]->batch_rendered = true;
+		capture_frame(batch->contexts[i]);
+		end_frame(batch->contexts[i]);
+	}
 }
 
 void vdp_blit(vdp_context_t *context, unsigned int x, unsigned int y, unsigned int width, unsigned int height, vdp_filter_t filter) {
-	glBlitNamedFramebuffer(context->framebuffer_fbo, 0, 0, 0, VDP_FRAMEBUFFER_WIDTH, VDP_FRAMEBUFFER_HEIGHT, (GLint)x, (GLint)y, (GLint)(x + width), (GLint)(y + height), GL_COLOR_BUFFER_BIT, filter == VDP_FILTER_BILINEAR ? GL_LINEAR : GL_NEAREST);
+	if (context->trace) {
+		vdp_trace_call(context->trace, VDP_TRACE_BLIT, NULL, 5, x, y, width, height, (uint32_t)filter);
+	}
+	if (context->queue) {
+		vdp_queue_call(context->queue, VDP_TRACE_BLIT, NULL, 5, x, y, width, height, (uint32_t)filter);
+		return;
+	}
+	// integer framebuffers cannot be blitted to the window
+	if (context->backend != VDP_BACKEND_OPENGL || context->format != VDP_FORMAT_RGBA8) {
+		return;
+	}
+	begin_timer(&context->blit_timer);
+	glBlitNamedFramebuffer(context->framebuffer_fbo[context->chain.front], 0, 0, 0, VDP_FRAMEBUFFER_WIDTH, VDP_FRAMEBUFFER_HEIGHT, (GLint)x, (GLint)y, (GLint)(x + width), (GLint)(y + height), GL_COLOR_BUFFER_BIT, filter == VDP_FILTER_BILINEAR ? GL_LINEAR : GL_NEAREST);
+	end_timer(&context->blit_timer);
+}
+
+static void get_framebuffer(vdp_context_t *context, size_t size, void *pixels) {
+	const vdp_batch_t *batch = context->batch;
+	const output_format_t *format = &output_formats[batch->format];
+	glGetTextureSubImage(batch->framebuffer_tex[context->chain.front], 0, 0, 0, context->layer, VDP_FRAMEBUFFER_WIDTH, VDP_FRAMEBUFFER_HEIGHT, 1, format->format, format->type, (GLsizei)size, pixels);
+}
+
+void vdp_read_pixels(vdp_context_t *context, void *pixels) {
+	const size_t pitch = VDP_FRAMEBUFFER_WIDTH * output_formats[context->format].pixel_size;
+	if (context->backend != VDP_BACKEND_OPENGL) {
+		memcpy(pixels, frame_pixels(context, context->chain.front), pitch * VDP_FRAMEBUFFER_HEIGHT);
+		return;
+	}
+
+	// GL rows are bottom-up, flip them so that every backend returns the same top-down image
+	get_framebuffer(context, pitch * VDP_FRAMEBUFFER_HEIGHT, pixels);
+	uint8_t row[VDP_FRAMEBUFFER_WIDTH * sizeof (uint32_t)];
+	for (unsigned int i = 0; i < VDP_FRAMEBUFFER_HEIGHT / 2; ++i) {
+		uint8_t *top = (uint8_t *)pixels + i * pitch;
+		uint8_t *bottom = (uint8_t *)pixels + (VDP_FRAMEBUFFER_HEIGHT - 1 - i) * pitch;
+		memcpy(row, top, pitch);
+		memcpy(top, bottom, pitch);
+		memcpy(bottom, row, pitch);
+	}
+}
+
+bool vdp_read_async(vdp_context_t *context) {
+	if (context->readback_count == READBACK_COUNT) {
+		return false;
+	}
+	readback_t *readback = &context->readbacks[(context->readback_head + context->readback_count) % READBACK_COUNT];
+	readback->pitch = VDP_FRAMEBUFFER_WIDTH * output_formats[context->format].pixel_size;
+	if (context->backend != VDP_BACKEND_OPENGL) {
+		if (!readback->data) {
+			readback->data = malloc(FRAMEBUFFER_SIZE);
+		}
+		memcpy(readback->data, frame_pixels(context, context->chain.front), readback->pitch * VDP_FRAMEBUFFER_HEIGHT);
+		++context->readback_count;
+		return true;
+	}
+
+	if (!readback->buffer) {
+		const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glCreateBuffers(1, &readback->buffer);
+		glNamedBufferStorage(readback->buffer, FRAMEBUFFER_SIZE, NULL, flags | GL_CLIENT_STORAGE_BIT);
+		readback->data = glMapNamedBufferRange(readback->buffer, 0, FRAMEBUFFER_SIZE, flags);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->buffer);
+	get_framebuffer(context, readback->pitch * VDP_FRAMEBUFFER_HEIGHT, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	readback->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	++context->readback_count;
+	return true;
+}
+
+bool vdp_read_poll(vdp_context_t *context, void *pixels) {
+	if (context->readback_count == 0) {
+		return false;
+	}
+	readback_t *readback = &context->readbacks[context->readback_head];
+	const size_t pitch = readback->pitch;
+	if (context->backend != VDP_BACKEND_OPENGL) {
+		memcpy(pixels, readback->data, pitch * VDP_FRAMEBUFFER_HEIGHT);
+	} else {
+		GLenum status = glClientWaitSync(readback->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+			return false;
+		}
+		glDeleteSync(readback->fence);
+		readback->fence = NULL;
+		for (unsigned int i = 0; i < VDP_FRAMEBUFFER_HEIGHT; ++i) {
+			memcpy((uint8_t *)pixels + i * pitch, (const uint8_t *)readback->data + (VDP_FRAMEBUFFER_HEIGHT - 1 - i) * pitch, pitch);
+		}
+	}
+	context->readback_head = (context->readback_head + 1) % READBACK_COUNT;
+	--context->readback_count;
+	return true;
 }
@@ -0,0 +1,218 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#version 450 core
+
+// one workgroup per line, one 8 pixel strip per invocation
+layout(local_size_x = 40) in;
+
+layout(location = 0) uniform int first_instance;
+
+layout(binding = 0) uniform sampler2DArray color_table;
+layout(binding = 1) uniform usampler2DArray pattern_table;
+layout(binding = 2) uniform usampler1DArray sprite_table;
+layout(binding = 3) uniform usampler2DArray plane_table;
+layout(binding = 4) uniform usampler1DArray hscroll_table;
+layout(binding = 5) uniform usampler1DArray vscroll_table;
+layout(binding = 6) uniform isampler2DArray register_table;
+layout(binding = 7) uniform usampler2DArray sprite_line_table;
+
+#if defined(OUTPUT_INDEX8)
+layout(binding = 0, r8ui) uniform writeonly uimage2DArray framebuffer;
+#elif defined(OUTPUT_RGB565)
+layout(binding = 0, r16ui) uniform writeonly uimage2DArray framebuffer;
+#else
+layout(binding = 0, rgba8) uniform writeonly image2DArray framebuffer;
+#endif
+
+const uvec2 pattern_size = uvec2(8, 8);
+const uint priority_mask = 0x40;
+const uint strip_count = 40;
+const uint column_count = 20;
+const uint max_line_sprites = 20;
+
+// everything the strips of a line have in common, fetched once per workgroup
+shared ivec4 line_registers[2];
+shared uint line_hscroll[2];
+shared uint line_vscroll[2][column_count];
+shared uint line_sprite_count;
+shared uvec4 line_sprites[max_line_sprites];
+shared uint line_sprite_widths[max_line_sprites];
+shared uvec2 line_cells[3][strip_count + 1]; // cell, pattern row
+
+int instance;
+// Program variants define the registers that do not change during the frame, see select_program in vdp.c.
+#ifdef INTENSITY_MODE
+const bool intensity_mode = INTENSITY_MODE;
+#else
+bool intensity_mode;
+#endif
+uint background_color;
+#ifdef PLANE_SIZE
+const uvec2 plane_size = PLANE_SIZE;
+#else
+uvec2 plane_size;
+#endif
+#ifdef WINDOW
+const ivec2 window = WINDOW;
+#else
+ivec2 window;
+#endif
+int palette;
+
+uvec2 flip(uvec2 p, uvec2 size, bvec2 dir) {
+	return mix(p, size - 1 - p, dir);
+}
+
+uint patternFetch(uvec2 p, uint cell) {
+	uint pattern = bitfieldExtract(cell, 0, 11);
+	uint palette = bitfieldExtract(cell, 13, 3);
+	uvec2 q = p & (pattern_size - 1);
+	return palette * 16 + texelFetch(pattern_table, ivec3(q.y * pattern_size.x + q.x, pattern, instance), 0).r;
+}
+
+uint cellFetch(uvec2 entry, uint x) {
+	uvec2 q = flip(uvec2(x & (pattern_size.x - 1), entry.y), pattern_size, bvec2(entry.x & 1u << 11, entry.x & 1u << 12));
+	return patternFetch(q, entry.x);
+}
+
+uint planeFetch(uvec2 p, uint layer) {
+	uint x = -line_hscroll[layer];
+	return cellFetch(line_cells[layer][(p.x + (x & (pattern_size.x - 1))) / pattern_size.x], p.x + x);
+}
+
+uint windowFetch(uvec2 p) {
+	return cellFetch(line_cells[2][p.x / pattern_size.x], p.x);
+}
+
+uint spriteFetch(uvec2 p) {
+	uint color = 0;
+	for (uint i = 0; i < line_sprite_count && (color & 0xFu) == 0; ++i) {
+		uvec4 sprite = line_sprites[i];
+		uvec2 size = ivec2(bitfieldExtract(sprite.g, 10, 2), bitfieldExtract(sprite.g, 8, 2)) * 8 + 8;
+		uvec2 d = p - uvec2(sprite.ar) + 128;
+		if (d.x < line_sprite_widths[i]) {
+			uvec2 q = flip(d, size, bvec2(sprite.b & 1u << 11, sprite.b & 1u << 12));
+			uint cell = sprite.b + (q.y / pattern_size.y) + (q.x / pattern_size.x) * (size.y / pattern_size.y);
+			color = patternFetch(q, cell);
+		}
+	}
+	return color;
+}
+
+// Stages the name table entries under the line, every cell of a scrolled plane lies in a single vscroll column.
+void stageCells(uint strip, uint y) {
+	const uint c = pattern_size.x * 2;
+	for (uint layer = 0; layer < 2; ++layer) {
+		uint x = -line_hscroll[layer];
+		for (uint j = strip; j <= strip_count; j += strip_count) {
+			int sx = clamp(int(j * pattern_size.x) - int(x & (pattern_size.x - 1)), 0, int(strip_count * pattern_size.x) - 1);
+			uint py = y + line_vscroll[layer][max((sx + int((x + c - 1) & (c - 1)) + 1) / int(c) - 1, 0)];
+			uvec2 cell = uvec2((x + j * pattern_size.x) / pattern_size.x, py / pattern_size.y) % plane_size;
+			line_cells[layer][j] = uvec2(texelFetch(plane_table, ivec3(cell, instance * 3 + layer), 0).r, py & (pattern_size.y - 1));
+		}
+	}
+	uvec2 cell = uvec2(strip, y / pattern_size.y) % plane_size;
+	line_cells[2][strip] = uvec2(texelFetch(plane_table, ivec3(cell, instance * 3 + 2), 0).r, y & (pattern_size.y - 1));
+}
+
+uint pixelFetch(uvec2 p) {
+	bool inside_window = window.x > 0 && p.x < window.x || window.x < 0 && p.x >= -window.x || window.y > 0 && p.y < window.y || window.y < 0 && p.y >= -window.y;
+	uint color_a = inside_window ? windowFetch(p) : planeFetch(p, 0);
+	uint color_b = planeFetch(p, 1);
+	uint color_s = spriteFetch(p);
+	uint color = background_color;
+	uint intensity = intensity_mode ? (color_a | color_b) & priority_mask : priority_mask;
+	if ((color_b & 0xF) != 0) {
+		color = color_b;
+	}
+	if ((color_a & 0xF) != 0 && (color_a & priority_mask) >= (color & priority_mask)) {
+		color = color_a;
+	}
+	if ((color_s & 0xF) != 0 && (color_s & priority_mask) >= (color & priority_mask)) {
+		if (intensity_mode) {
+			if ((color_s & 0x3F) == 0x3E) {
+				intensity += priority_mask;
+			} else if ((color_s & 0x3F) == 0x3F) {
+				intensity = 0;
+			} else {
+				color = color_s;
+				intensity |= (color & 0xF) == 0xE ? priority_mask : color & priority_mask; // Emulate S&H color 14 bug...
+			}
+		} else {
+			color = color_s;
+		}
+	}
+	return color & 0x3F | intensity;
+}
+
+void pixelStore(uvec2 p, uint index) {
+	ivec3 q = ivec3(p.x, 223 - p.y, instance);
+#if defined(OUTPUT_INDEX8)
+	imageStore(framebuffer, q, uvec4(index));
+#elif defined(OUTPUT_RGB565)
+	uvec3 c = uvec3(round(texelFetch(color_table, ivec3(index, palette, instance), 0).rgb * vec3(31, 63, 31)));
+	imageStore(framebuffer, q, uvec4(c.r << 11 | c.g << 5 | c.b));
+#else
+	imageStore(framebuffer, q, texelFetch(color_table, ivec3(index, palette, instance), 0));
+#endif
+}
+
+void main() {
+	uint strip = gl_LocalInvocationID.x;
+	uint y = gl_WorkGroupID.y;
+	instance = first_instance + int(gl_WorkGroupID.z);
+
+	if (strip < 2) {
+		line_registers[strip] = texelFetch(register_table, ivec3(strip, y, instance), 0);
+		line_hscroll[strip] = texelFetch(hscroll_table, ivec2(y, instance * 2 + int(strip)), 0).r;
+	}
+	if (strip < column_count) {
+		line_vscroll[0][strip] = texelFetch(vscroll_table, ivec2(strip, instance * 2), 0).r;
+		line_vscroll[1][strip] = texelFetch(vscroll_table, ivec2(strip, instance * 2 + 1), 0).r;
+	}
+	if (strip < max_line_sprites) {
+		uint entry = texelFetch(sprite_line_table, ivec3(strip + 1, y, instance), 0).r;
+		line_sprites[strip] = texelFetch(sprite_table, ivec2(bitfieldExtract(entry, 0, 7), instance), 0);
+		line_sprite_widths[strip] = bitfieldExtract(entry, 8, 8);
+	}
+	if (strip == 0) {
+		line_sprite_count = texelFetch(sprite_line_table, ivec3(0, y, instance), 0).r;
+	}
+	barrier();
+
+#ifndef INTENSITY_MODE
+	intensity_mode = line_registers[0].x != 0;
+#endif
+	background_color = uint(line_registers[0].y);
+#ifndef PLANE_SIZE
+	plane_size = uvec2(line_registers[0].zw);
+#endif
+#ifndef WINDOW
+	window = line_registers[1].xy;
+#endif
+	palette = line_registers[1].z;
+	stageCells(strip, y);
+	barrier();
+
+	for (uint x = 0; x < pattern_size.x; ++x) {
+		uvec2 p = uvec2(strip * pattern_size.x + x, y);
+		pixelStore(p, pixelFetch(p));
+	}
+}
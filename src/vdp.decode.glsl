@@ -0,0 +1,43 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#version 450 core
+
+layout(local_size_x = 64) in;
+
+layout(location = 0) uniform int instance;
+layout(location = 1) uniform uint first_strip;
+layout(location = 2) uniform uint strip_count;
+
+layout(binding = 1) uniform usampler2DArray pattern_table;
+
+// one byte per pixel, the 8 rows of a pattern side by side
+layout(binding = 0, r8ui) uniform writeonly uimage2DArray pattern_index_table;
+
+void main() {
+	uint i = gl_GlobalInvocationID.x;
+	if (i >= strip_count) {
+		return;
+	}
+	uint strip = first_strip + i;
+	uint bits = texelFetch(pattern_table, ivec3(strip & 7, strip / 8, instance), 0).r;
+	for (uint x = 0; x < 8; ++x) {
+		imageStore(pattern_index_table, ivec3((strip & 7) * 8 + x, strip / 8, instance), uvec4(bitfieldExtract(bits, int(x) * 4 ^ 4, 4)));
+	}
+}
@@ -19,23 +19,46 @@
 
 #version 450 core
 
-layout(location = 0) uniform bool intensity_mode;
-layout(location = 1) uniform uint background_color;
-layout(location = 2) uniform uvec2 plane_size;
-layout(location = 3) uniform ivec2 window;
-
-layout(binding = 0) uniform sampler1D color_table;
+layout(binding = 0) uniform sampler2DArray color_table;
 layout(binding = 1) uniform usampler2DArray pattern_table;
-layout(binding = 2) uniform usampler1D sprite_table;
+layout(binding = 2) uniform usampler1DArray sprite_table;
 layout(binding = 3) uniform usampler2DArray plane_table;
 layout(binding = 4) uniform usampler1DArray hscroll_table;
 layout(binding = 5) uniform usampler1DArray vscroll_table;
+layout(binding = 6) uniform isampler2DArray register_table;
+layout(binding = 7) uniform usampler2DArray sprite_line_table;
+
+layout(location = 0) uniform ivec4 target; // viewport the framebuffer is scaled to
+
+flat in int instance;
 
+#if defined(OUTPUT_INDEX8) || defined(OUTPUT_RGB565)
+out uint pixel;
+#else
 out vec4 pixel;
+#endif
+
+// Program variants define the registers that do not change during the frame, see select_program in vdp.c.
+#ifdef INTENSITY_MODE
+const bool intensity_mode = INTENSITY_MODE;
+#else
+bool intensity_mode;
+#endif
+uint background_color;
+#ifdef PLANE_SIZE
+const uvec2 plane_size = PLANE_SIZE;
+#else
+uvec2 plane_size;
+#endif
+#ifdef WINDOW
+const ivec2 window = WINDOW;
+#else
+ivec2 window;
+#endif
+int palette;
 
 const uvec2 pattern_size = uvec2(8, 8);
 const uint priority_mask = 0x40;
-const int max_sprite_count = 80;
 
 uvec2 flip(uvec2 p, uvec2 size, bvec2 dir) {
 	return mix(p, size - 1 - p, dir);
@@ -44,42 +67,56 @@ uvec2 flip(uvec2 p, uvec2 size, bvec2 dir) {
 uint patternFetch(uvec2 p, uint cell) {
 	uint pattern = bitfieldExtract(cell, 0, 11);
 	uint palette = bitfieldExtract(cell, 13, 3);
-	uint strip = texelFetch(pattern_table, ivec3(0, p.y & (pattern_size.y - 1), pattern), 0).r;
-	return palette * 16 + bitfieldExtract(strip, int(p.x & (pattern_size.x - 1)) * 4 ^ 4, 4);
+	uvec2 q = p & (pattern_size - 1);
+	return palette * 16 + texelFetch(pattern_table, ivec3(q.y * pattern_size.x + q.x, pattern, instance), 0).r;
 }
 
 uint planeFetch(uvec2 p, uint layer) {
-	uint cell = texelFetch(plane_table, ivec3(p / pattern_size % plane_size, layer), 0).r;
+	uint cell = texelFetch(plane_table, ivec3(p / pattern_size % plane_size, instance * 3 + layer), 0).r;
 	uvec2 q = flip(p, pattern_size, bvec2(cell & 1u << 11, cell & 1u << 12));
 	return patternFetch(q, cell);
 }
 
 uint spriteFetch(uvec2 p) {
-	int i = 0;
-	int link = 0;
+	uint count = texelFetch(sprite_line_table, ivec3(0, p.y, instance), 0).r;
 	uint color = 0;
-	do {
-		uvec4 sprite = texelFetch(sprite_table, link, 0);
-		link = int(bitfieldExtract(sprite.g, 0, 7));
+	for (uint i = 1; i <= count && (color & 0xFu) == 0; ++i) {
+		uint entry = texelFetch(sprite_line_table, ivec3(i, p.y, instance), 0).r;
+		uvec4 sprite = texelFetch(sprite_table, ivec2(bitfieldExtract(entry, 0, 7), instance), 0);
 		uvec2 size = ivec2(bitfieldExtract(sprite.g, 10, 2), bitfieldExtract(sprite.g, 8, 2)) * 8 + 8;
-		uvec2 q = flip(p - uvec2(sprite.ar) + 128, size, bvec2(sprite.b & 1u << 11, sprite.b & 1u << 12));
-		if (all(greaterThanEqual(q, ivec2(0, 0))) && all(lessThan(q, size))) {
+		uvec2 d = p - uvec2(sprite.ar) + 128;
+		if (d.x < bitfieldExtract(entry, 8, 8)) {
+			uvec2 q = flip(d, size, bvec2(sprite.b & 1u << 11, sprite.b & 1u << 12));
 			uint cell = sprite.b + (q.y / pattern_size.y) + (q.x / pattern_size.x) * (size.y / pattern_size.y);
 			color = patternFetch(q, cell);
 		}
-	} while (i++ < max_sprite_count && link != 0 && (color & 0xFu) == 0);
+	}
 	return color;
 }
 
 uvec2 scrollFetch(uvec2 p, int layer) {
 	const uint c = pattern_size.x * 2;
-	uint x = -texelFetch(hscroll_table, ivec2(p.y, layer), 0).r;
-	uint y = texelFetch(vscroll_table, ivec2(max((int(p.x + ((x + c - 1) & (c - 1)) + 1)) / int(c) - 1, 0), layer), 0).r;
+	uint x = -texelFetch(hscroll_table, ivec2(p.y, instance * 2 + layer), 0).r;
+	uint y = texelFetch(vscroll_table, ivec2(max((int(p.x + ((x + c - 1) & (c - 1)) + 1)) / int(c) - 1, 0), instance * 2 + layer), 0).r;
 	return uvec2(x, y);
 }
 
 void main() {
-	uvec2 p = uvec2(gl_FragCoord.x, 224 - gl_FragCoord.y);
+	ivec2 q = ((ivec2(gl_FragCoord.xy) - target.xy) * 2 + 1) * ivec2(320, 224) / (target.zw * 2); // nearest
+	uvec2 p = uvec2(q.x, 223 - q.y);
+	ivec4 registers = texelFetch(register_table, ivec3(0, p.y, instance), 0);
+#ifndef INTENSITY_MODE
+	intensity_mode = registers.x != 0;
+#endif
+	background_color = uint(registers.y);
+#ifndef PLANE_SIZE
+	plane_size = uvec2(registers.zw);
+#endif
+	registers = texelFetch(register_table, ivec3(1, p.y, instance), 0);
+#ifndef WINDOW
+	window = registers.xy;
+#endif
+	palette = registers.z;
 	uvec2 scroll_a = scrollFetch(p, 0);
 	uvec2 scroll_b = scrollFetch(p, 1);
 	bool inside_window = window.x > 0 && p.x < window.x || window.x < 0 && p.x >= -window.x || window.y > 0 && p.y < window.y || window.y < 0 && p.y >= -window.y;
@@ -108,5 +145,12 @@ void main() {
 			color = color_s;
 		}
 	}
-	pixel = texelFetch(color_table, int(color & 0x3F | intensity), 0);
+#if defined(OUTPUT_INDEX8)
+	pixel = color & 0x3F | intensity;
+#elif defined(OUTPUT_RGB565)
+	uvec3 c = uvec3(round(texelFetch(color_table, ivec3(color & 0x3F | intensity, palette, instance), 0).rgb * vec3(31, 63, 31)));
+	pixel = c.r << 11 | c.g << 5 | c.b;
+#else
+	pixel = texelFetch(color_table, ivec3(color & 0x3F | intensity, palette, instance), 0);
+#endif
 }
@@ -22,16 +22,27 @@
 layout(points) in;
 layout(triangle_strip, max_vertices = 4) out;
 
+in int instance_id[];
+flat out int instance;
+
 void main() {
+	gl_Layer = instance_id[0];
+	instance = instance_id[0];
 	gl_Position = vec4(1.0, 1.0, 0.0, 1.0);
 	EmitVertex();
 
+	gl_Layer = instance_id[0];
+	instance = instance_id[0];
 	gl_Position = vec4(-1.0, 1.0, 0.0, 1.0);
 	EmitVertex();
 
+	gl_Layer = instance_id[0];
+	instance = instance_id[0];
 	gl_Position = vec4( 1.0, -1.0, 0.0, 1.0);
 	EmitVertex();
 
+	gl_Layer = instance_id[0];
+	instance = instance_id[0];
 	gl_Position = vec4(-1.0, -1.0, 0.0, 1.0);
 	EmitVertex();
 
@@ -0,0 +1,63 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#version 450 core
+
+layout(local_size_x = 32) in;
+
+layout(location = 0) uniform int first_instance;
+
+layout(binding = 2) uniform usampler1DArray sprite_table;
+
+// per line: sprite count, then sprite index | visible width << 8 in link order
+layout(binding = 0, r16ui) uniform writeonly uimage2DArray sprite_line_table;
+
+const int max_sprite_count = 80;
+const uint max_line_sprites = 20;
+const uint max_line_cells = 40;
+
+void main() {
+	uint y = gl_GlobalInvocationID.x;
+	int instance = first_instance + int(gl_WorkGroupID.y);
+	if (y >= 224) {
+		return;
+	}
+
+	int i = 0;
+	int link = 0;
+	uint count = 0;
+	uint cells = 0;
+	do {
+		uvec4 sprite = texelFetch(sprite_table, ivec2(link, instance), 0);
+		uint index = link;
+		link = int(bitfieldExtract(sprite.g, 0, 7));
+		if (y - sprite.r + 128 < bitfieldExtract(sprite.g, 8, 2) * 8 + 8) {
+			if (count == max_line_sprites) {
+				break;
+			}
+			uint width = min(bitfieldExtract(sprite.g, 10, 2) + 1, max_line_cells - cells);
+			imageStore(sprite_line_table, ivec3(++count, y, instance), uvec4(index | width * 8 << 8));
+			cells += width;
+			if (cells == max_line_cells) {
+				break;
+			}
+		}
+	} while (++i < max_sprite_count && link != 0);
+	imageStore(sprite_line_table, ivec3(0, y, instance), uvec4(count));
+}
@@ -0,0 +1,100 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#version 450 core
+
+layout(local_size_x = 64) in;
+
+layout(location = 0) uniform int instance;
+
+// vdp_native_t: VRAM bytes in VDP order, then host order CRAM, VSRAM and register bytes (CRAM is decoded on the CPU)
+layout(binding = 0, std430) readonly buffer native_memory {
+	uint memory[];
+};
+
+layout(binding = 1, r32ui) uniform writeonly uimage2DArray pattern_table;
+layout(binding = 2, rgba16ui) uniform writeonly uimage1DArray sprite_table;
+layout(binding = 3, r16ui) uniform writeonly uimage2DArray plane_table;
+layout(binding = 4, r16ui) uniform writeonly uimage1DArray hscroll_table;
+layout(binding = 5, r16ui) uniform writeonly uimage1DArray vscroll_table;
+layout(binding = 6) uniform isampler2DArray register_table;
+
+const uint vram_size = 0x10000;
+const uint cram_offset = vram_size / 4;
+const uint vsram_offset = cram_offset + 64 / 2;
+const uint register_offset = vsram_offset + 40 / 2;
+
+uint vramWord(uint address) {
+	uint word = memory[(address & (vram_size - 1)) / 4] >> (address & 2) * 8;
+	return (word & 0xFF) << 8 | bitfieldExtract(word, 8, 8);
+}
+
+uint vsramWord(uint i) {
+	return bitfieldExtract(memory[vsram_offset + i / 2], int(i & 1) * 16, 16);
+}
+
+uint vdpRegister(uint i) {
+	return bitfieldExtract(memory[register_offset + i / 4], int(i & 3) * 8, 8);
+}
+
+uint planeSize(uint size) {
+	return size == 0 ? 32 : size == 1 ? 64 : 128;
+}
+
+void main() {
+	uint i = gl_GlobalInvocationID.x;
+
+	// patterns are used as is, one strip per invocation
+	imageStore(pattern_table, ivec3(i & 7, i / 8, instance), uvec4(memory[i]));
+
+	uvec2 plane_size = uvec2(planeSize(bitfieldExtract(vdpRegister(16), 0, 2)), planeSize(bitfieldExtract(vdpRegister(16), 4, 2)));
+	if (i < plane_size.x * plane_size.y) {
+		uint bases[3] = uint[3](
+			(vdpRegister(2) & 0x38) << 10,
+			(vdpRegister(4) & 0x07) << 13,
+			(vdpRegister(3) & 0x3C) << 10
+		);
+		ivec2 p = ivec2(i % plane_size.x, i / plane_size.x);
+		for (int plane = 0; plane < 3; ++plane) {
+			imageStore(plane_table, ivec3(p, instance * 3 + plane), uvec4(vramWord(bases[plane] + i * 2)));
+		}
+	}
+
+	if (i < 128) {
+		uint address = ((vdpRegister(5) & 0x7E) << 9) + i * 8;
+		imageStore(sprite_table, ivec2(i, instance), uvec4(vramWord(address), vramWord(address + 2), vramWord(address + 4), vramWord(address + 6)));
+	}
+
+	// the hscroll table layout may change mid-frame, lines past the display use the last one
+	if (i < 256) {
+		uint hscroll = uint(texelFetch(register_table, ivec3(1, min(i, 223), instance), 0).w);
+		uint mode = hscroll & 3;
+		uint line = mode == 0 ? 0 : mode == 2 ? i & ~7u : i;
+		uint address = (hscroll & ~3u) + line * 4;
+		imageStore(hscroll_table, ivec2(i, instance * 2 + 0), uvec4(vramWord(address + 0)));
+		imageStore(hscroll_table, ivec2(i, instance * 2 + 1), uvec4(vramWord(address + 2)));
+	}
+
+	if (i < 20) {
+		uint column = (vdpRegister(11) & 4) != 0 ? i * 2 : 0;
+		imageStore(vscroll_table, ivec2(i, instance * 2 + 0), uvec4(vsramWord(column + 0)));
+		imageStore(vscroll_table, ivec2(i, instance * 2 + 1), uvec4(vsramWord(column + 1)));
+	}
+
+}
@@ -19,5 +19,8 @@
 
 #version 450 core
 
+out int instance_id;
+
 void main() {
+	instance_id = gl_VertexID;
 }
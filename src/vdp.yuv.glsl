@@ -0,0 +1,70 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#version 450 core
+
+// Converts the RGBA8 framebuffer of an instance to top-down planar YUV 4:2:0, BT.601 limited range.
+// Every invocation covers 8x2 pixels: two words of luma per row and one word of each chroma plane,
+// with the same integer math as vdp_convert_yuv.
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+layout(location = 0) uniform int instance;
+
+layout(binding = 0) uniform sampler2DArray framebuffer;
+
+layout(std430, binding = 0) writeonly buffer yuv_buffer {
+	uint yuv[];
+};
+
+const uint width = 320;
+const uint height = 224;
+
+void main() {
+	uvec2 block = gl_GlobalInvocationID.xy;
+	if (block.x >= width / 8 || block.y >= height / 2) {
+		return;
+	}
+	uint x0 = block.x * 8;
+	uint y0 = block.y * 2;
+	uvec2 luma[2] = uvec2[](uvec2(0), uvec2(0));
+	uint u = 0;
+	uint v = 0;
+	for (uint i = 0; i < 4; ++i) {
+		uvec3 sum = uvec3(0);
+		for (uint j = 0; j < 4; ++j) {
+			uint x = i * 2 + (j & 1);
+			uint y = j >> 1;
+			uvec3 c = uvec3(round(texelFetch(framebuffer, ivec3(x0 + x, height - 1 - y0 - y, instance), 0).rgb * 255.0));
+			luma[y][x >> 2] |= (((66 * c.r + 129 * c.g + 25 * c.b + 128) >> 8) + 16) << (x & 3) * 8;
+			sum += c;
+		}
+		uvec3 c = (sum + 2) >> 2;
+		u |= ((112 * c.b - 38 * c.r - 74 * c.g + 32896) >> 8) << i * 8;
+		v |= ((112 * c.r - 94 * c.g - 18 * c.b + 32896) >> 8) << i * 8;
+	}
+	uint offset = (y0 * width + x0) / 4;
+	yuv[offset] = luma[0].x;
+	yuv[offset + 1] = luma[0].y;
+	yuv[offset + width / 4] = luma[1].x;
+	yuv[offset + width / 4 + 1] = luma[1].y;
+	offset = (block.y * width / 2 + block.x * 4) / 4;
+	yuv[width * height / 4 + offset] = u;
+	yuv[width * height * 5 / 16 + offset] = v;
+}
@@ -0,0 +1,105 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "vdp_internal.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Y4M writer behind vdp_start_capture. A path starting with '|' is run as a command that
+// receives the stream on its standard input, e.g. "|ffmpeg -i - capture.mkv".
+
+struct vdp_capture {
+	FILE *file;
+	bool pipe;
+	bool failed;
+};
+
+vdp_capture_t *vdp_create_capture(const char *path) {
+	const bool pipe = path[0] == '|';
+	FILE *file = pipe ? popen(path + 1, "w") : fopen(path, "wb");
+	if (!file) {
+		fprintf(stderr, "Unable to open capture '%s'.\n", path);
+		return NULL;
+	}
+	if (fprintf(file, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n", VDP_FRAMEBUFFER_WIDTH, VDP_FRAMEBUFFER_HEIGHT) < 0) {
+		fprintf(stderr, "Unable to write capture '%s'.\n", path);
+		if (pipe) {
+			pclose(file);
+		} else {
+			fclose(file);
+		}
+		return NULL;
+	}
+	vdp_capture_t *capture = calloc(1, sizeof (vdp_capture_t));
+	capture->file = file;
+	capture->pipe = pipe;
+	return capture;
+}
+
+void vdp_destroy_capture(vdp_capture_t *capture) {
+	if (capture) {
+		if (capture->pipe) {
+			pclose(capture->file);
+		} else {
+			fclose(capture->file);
+		}
+		free(capture);
+	}
+}
+
+// Once a write fails nothing more is written, a truncated frame would desynchronize the rest of the stream.
+bool vdp_capture_frame(vdp_capture_t *capture, const void *yuv) {
+	if (capture->failed) {
+		return false;
+	}
+	if (fputs("FRAME\n", capture->file) < 0 || fwrite(yuv, 1, VDP_CAPTURE_FRAME_SIZE, capture->file) != VDP_CAPTURE_FRAME_SIZE) {
+		fprintf(stderr, "Unable to write capture frame, stopping the capture.\n");
+		capture->failed = true;
+	}
+	return !capture->failed;
+}
+
+void vdp_convert_yuv(const uint32_t *pixels, uint8_t *yuv) {
+	const unsigned int width = VDP_FRAMEBUFFER_WIDTH;
+	const unsigned int height = VDP_FRAMEBUFFER_HEIGHT;
+	uint8_t *u_plane = yuv + width * height;
+	uint8_t *v_plane = u_plane + width * height / 4;
+	for (unsigned int y = 0; y < height; y += 2) {
+		for (unsigned int x = 0; x < width; x += 2) {
+			uint32_t sum[3] = { 0, 0, 0 };
+			for (unsigned int j = 0; j < 4; ++j) {
+				const uint32_t pixel = pixels[(y + (j >> 1)) * width + x + (j & 1)];
+				const uint32_t r = pixel & 0xFF;
+				const uint32_t g = pixel >> 8 & 0xFF;
+				const uint32_t b = pixel >> 16 & 0xFF;
+				yuv[(y + (j >> 1)) * width + x + (j & 1)] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+				sum[0] += r;
+				sum[1] += g;
+				sum[2] += b;
+			}
+			const uint32_t r = (sum[0] + 2) >> 2;
+			const uint32_t g = (sum[1] + 2) >> 2;
+			const uint32_t b = (sum[2] + 2) >> 2;
+			u_plane[y / 2 * width / 2 + x / 2] = (uint8_t)((112 * b - 38 * r - 74 * g + 32896) >> 8);
+			v_plane[y / 2 * width / 2 + x / 2] = (uint8_t)((112 * r - 94 * g - 18 * b + 32896) >> 8);
+		}
+	}
+}
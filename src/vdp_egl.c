@@ -0,0 +1,167 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <vdp.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifdef VDP_HAVE_EGL
+
+#include <GL/glcorearb.h>
+#include <GL/gl3w.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <string.h>
+
+struct vdp_headless {
+	EGLDisplay display;
+	EGLSurface surface;
+	EGLContext context;
+};
+
+static int has_extension(const char *extensions, const char *name) {
+	size_t length = strlen(name);
+	while (extensions && (extensions = strstr(extensions, name))) {
+		if (extensions[length] == ' ' || extensions[length] == '\0') {
+			return 1;
+		}
+		extensions += length;
+	}
+	return 0;
+}
+
+static EGLDisplay get_display() {
+	const char *extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (has_extension(extensions, "EGL_MESA_platform_surfaceless")) {
+		PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (get_platform_display) {
+			EGLDisplay display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+			if (display != EGL_NO_DISPLAY) {
+				return display;
+			}
+		}
+	}
+	return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+vdp_headless_t *vdp_create_headless() {
+	vdp_headless_t *headless = calloc(1, sizeof (vdp_headless_t));
+	headless->display = get_display();
+	if (headless->display == EGL_NO_DISPLAY || !eglInitialize(headless->display, NULL, NULL)) {
+		fprintf(stderr, "Unable to initialize EGL display.\n");
+		free(headless);
+		return NULL;
+	}
+	if (!eglBindAPI(EGL_OPENGL_API)) {
+		fprintf(stderr, "EGL does not support desktop OpenGL.\n");
+		vdp_destroy_headless(headless);
+		return NULL;
+	}
+
+	// surfaceless when possible, otherwise a 1x1 pbuffer just to have something to make current
+	const EGLint config_attribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8,
+		EGL_GREEN_SIZE, 8,
+		EGL_BLUE_SIZE, 8,
+		EGL_NONE
+	};
+	EGLConfig config = NULL;
+	EGLint config_count = 0;
+	eglChooseConfig(headless->display, config_attribs, &config, 1, &config_count);
+	int surfaceless = has_extension(eglQueryString(headless->display, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context");
+	if (!surfaceless) {
+		const EGLint pbuffer_attribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+		headless->surface = config_count ? eglCreatePbufferSurface(headless->display, config, pbuffer_attribs) : EGL_NO_SURFACE;
+		if (headless->surface == EGL_NO_SURFACE) {
+			fprintf(stderr, "Unable to create EGL pbuffer surface.\n");
+			vdp_destroy_headless(headless);
+			return NULL;
+		}
+	}
+
+	const EGLint context_attribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 5,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	headless->context = eglCreateContext(headless->display, config_count ? config : (EGLConfig)0, EGL_NO_CONTEXT, context_attribs);
+	if (headless->context == EGL_NO_CONTEXT) {
+		fprintf(stderr, "Unable to create OpenGL 4.5 core context.\n");
+		vdp_destroy_headless(headless);
+		return NULL;
+	}
+	if (!eglMakeCurrent(headless->display, headless->surface, headless->surface, headless->context)) {
+		fprintf(stderr, "Unable to make OpenGL context current.\n");
+		vdp_destroy_headless(headless);
+		return NULL;
+	}
+	if (gl3wInit2((GL3WGetProcAddressProc)eglGetProcAddress)) {
+		fprintf(stderr, "Failed to initialize OpenGL.\n");
+		vdp_destroy_headless(headless);
+		return NULL;
+	}
+	return headless;
+}
+
+void vdp_bind_headless(vdp_headless_t *headless) {
+	eglMakeCurrent(headless->display, headless->surface, headless->surface, headless->context);
+}
+
+void vdp_unbind_headless(vdp_headless_t *headless) {
+	eglMakeCurrent(headless->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
+void vdp_destroy_headless(vdp_headless_t *headless) {
+	if (headless) {
+		eglMakeCurrent(headless->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		if (headless->context != EGL_NO_CONTEXT) {
+			eglDestroyContext(headless->display, headless->context);
+		}
+		if (headless->surface != EGL_NO_SURFACE) {
+			eglDestroySurface(headless->display, headless->surface);
+		}
+		eglTerminate(headless->display);
+		free(headless);
+	}
+}
+
+#else
+
+vdp_headless_t *vdp_create_headless() {
+	fprintf(stderr, "Headless rendering requires glvdp to be built with EGL.\n");
+	return NULL;
+}
+
+void vdp_bind_headless(vdp_headless_t *headless) {
+	(void)headless;
+}
+
+void vdp_unbind_headless(vdp_headless_t *headless) {
+	(void)headless;
+}
+
+void vdp_destroy_headless(vdp_headless_t *headless) {
+	(void)headless;
+}
+
+#endif
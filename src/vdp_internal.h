@@ -0,0 +1,133 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#pragma once
+
+#include <vdp.h>
+
+#include <stdint.h>
+
+enum {
+	VDP_PALETTE_COUNT = 16,
+	VDP_LINE_SPRITE_COUNT = 20,
+	VDP_LINE_SPRITE_CELLS = 40,
+	VDP_CAPTURE_FRAME_SIZE = VDP_FRAMEBUFFER_WIDTH * VDP_FRAMEBUFFER_HEIGHT * 3 / 2,
+};
+
+// Registers in effect on one scanline, two RGBA32I texels of the register table.
+typedef struct vdp_line {
+	uint32_t intensity_mode;
+	uint32_t background_color;
+	uint32_t plane_size[2];
+	int32_t window[2];
+	uint32_t palette;
+	uint32_t hscroll; // native hscroll table address | mode
+} vdp_line_t;
+
+// Plain C mirror of everything the fragment shader reads, laid out exactly like the textures.
+typedef struct vdp_state {
+	vdp_line_t lines[VDP_FRAMEBUFFER_HEIGHT];
+	uint32_t color_table[VDP_PALETTE_COUNT][VDP_COLOR_COUNT * 4];
+	uint32_t pattern_table[VDP_PATTERN_COUNT][VDP_PATTERN_HEIGHT];
+	uint16_t sprite_table[VDP_SPRITE_COUNT][4];
+	uint16_t plane_table[VDP_PLANE_COUNT][VDP_PLANE_MAX_HEIGHT][VDP_PLANE_MAX_WIDTH];
+	uint16_t hscroll_table[2][VDP_HSCROLL_COUNT];
+	uint16_t vscroll_table[2][VDP_VSCROLL_COUNT];
+	uint16_t sprite_lines[VDP_FRAMEBUFFER_HEIGHT][VDP_LINE_SPRITE_COUNT + 1]; // derived from sprite_table
+} vdp_state_t;
+
+// Raw VDP memories as handed over by an emulator, mirrored verbatim in the native memory buffer.
+typedef struct vdp_native {
+	uint8_t vram[VDP_VRAM_SIZE];
+	uint16_t cram[VDP_CRAM_COUNT];
+	uint16_t vsram[VDP_VSRAM_COUNT];
+	uint8_t registers[VDP_REGISTER_COUNT];
+} vdp_native_t;
+
+typedef struct vdp_software vdp_software_t;
+typedef struct vdp_trace vdp_trace_t;
+typedef struct vdp_capture vdp_capture_t;
+
+// Calls recorded in traces, the numbering is part of the trace format.
+typedef enum vdp_trace_op {
+	VDP_TRACE_LINE,
+	VDP_TRACE_MODE,
+	VDP_TRACE_BACKGROUND_COLOR,
+	VDP_TRACE_PLANE_SIZE,
+	VDP_TRACE_WINDOW_COORD,
+	VDP_TRACE_BEGIN_UPDATE,
+	VDP_TRACE_COMMIT_UPDATE,
+	VDP_TRACE_COLORS,
+	VDP_TRACE_COLORS_SH,
+	VDP_TRACE_PATTERNS,
+	VDP_TRACE_SPRITES,
+	VDP_TRACE_CELLS,
+	VDP_TRACE_HSCROLL,
+	VDP_TRACE_VSCROLL,
+	VDP_TRACE_VRAM,
+	VDP_TRACE_CRAM,
+	VDP_TRACE_VSRAM,
+	VDP_TRACE_REGISTERS,
+	VDP_TRACE_RENDER,
+	VDP_TRACE_BLIT,
+	VDP_TRACE_RENDER_TO
+} vdp_trace_op_t;
+
+// Renders one frame into a top-down VDP_FRAMEBUFFER_WIDTH x VDP_FRAMEBUFFER_HEIGHT buffer of the given format.
+void vdp_render_reference(const vdp_state_t *state, vdp_format_t format, void *pixels);
+
+// Resolves one line of color indices (color | intensity) the way the render programs write them out.
+void vdp_output_line(const vdp_state_t *state, uint32_t y, const uint8_t *index, vdp_format_t format, void *pixels);
+
+// Lists the sprites of every line the same way vdp.sprites.glsl does: count, then index | visible width << 8.
+void vdp_build_sprite_lines(vdp_state_t *state);
+
+// Thread pool backed scanline renderer, thread_count 0 uses one thread per online processor.
+vdp_software_t *vdp_create_software(unsigned int thread_count);
+void vdp_destroy_software(vdp_software_t *software);
+void vdp_render_software(vdp_software_t *software, const vdp_state_t *state, vdp_format_t format, void *pixels);
+
+// Decode native memory the same way vdp.unpack.glsl does. Registers and colors are decoded on the CPU
+// so that they can change from one scanline to the next, leaving the palette index of the line untouched.
+void vdp_resolve_registers(vdp_line_t *line, const vdp_native_t *native);
+void vdp_resolve_cram(uint32_t *color_table, const uint16_t *cram, unsigned int start, unsigned int count);
+void vdp_resolve_tables(vdp_state_t *state, const vdp_native_t *native);
+
+// Call recorder behind vdp_start_trace, arguments are passed as uint32_t and data is the call payload if any.
+vdp_trace_t *vdp_create_trace(const char *path);
+void vdp_destroy_trace(vdp_trace_t *trace);
+void vdp_trace_call(vdp_trace_t *trace, vdp_trace_op_t op, const void *data, unsigned int arg_count, ...);
+
+// Payload size of a recorded call, 0 when it carries none or would be rejected.
+size_t vdp_trace_payload_size(vdp_trace_op_t op, const uint32_t *args);
+
+// Makes a recorded call, renders and blits excepted.
+void vdp_trace_apply(vdp_context_t *context, vdp_trace_op_t op, const uint32_t *args, const void *data);
+
+// Producer side of a queue, same calling convention as vdp_trace_call.
+void vdp_queue_call(vdp_queue_t *queue, vdp_trace_op_t op, const void *data, unsigned int arg_count, ...);
+
+// Y4M writer behind vdp_start_capture, each frame is VDP_CAPTURE_FRAME_SIZE bytes of planar YUV 4:2:0.
+// Writing a frame returns false once a write has failed.
+vdp_capture_t *vdp_create_capture(const char *path);
+void vdp_destroy_capture(vdp_capture_t *capture);
+bool vdp_capture_frame(vdp_capture_t *capture, const void *yuv);
+
+// Converts a top-down RGBA8 frame to YUV 4:2:0 the same way vdp.yuv.glsl does.
+void vdp_convert_yuv(const uint32_t *pixels, uint8_t *yuv);
@@ -0,0 +1,109 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "vdp_internal.h"
+
+#include <string.h>
+
+static uint16_t vram_word(const vdp_native_t *native, uint32_t address) {
+	address &= VDP_VRAM_SIZE - 2;
+	return (uint16_t)(native->vram[address] << 8 | native->vram[address + 1]);
+}
+
+static uint32_t plane_size(uint32_t size) {
+	return size == 0 ? 32 : size == 1 ? 64 : 128;
+}
+
+static uint8_t color_component(uint16_t color, int offset) {
+	uint32_t c = color >> offset & 7;
+	return (uint8_t)(c << 5 | c << 2 | c >> 1);
+}
+
+// Same byte layout as a GL_RGBA / GL_UNSIGNED_BYTE texel.
+static uint32_t rgba(uint32_t r, uint32_t g, uint32_t b) {
+	const uint8_t texel[4] = { (uint8_t)r, (uint8_t)g, (uint8_t)b, 0xFF };
+	uint32_t color;
+	memcpy(&color, texel, sizeof (color));
+	return color;
+}
+
+void vdp_resolve_registers(vdp_line_t *line, const vdp_native_t *native) {
+	const uint8_t *registers = native->registers;
+	line->intensity_mode = (registers[12] & 0x08) != 0;
+	line->background_color = registers[7] & 0x3F;
+	line->plane_size[0] = plane_size(registers[16] & 3);
+	line->plane_size[1] = plane_size(registers[16] >> 4 & 3);
+	line->window[0] = (registers[17] & 0x1F) * ((registers[17] & 0x80) ? -16 : 16);
+	line->window[1] = (registers[18] & 0x1F) * ((registers[18] & 0x80) ? -8 : 8);
+	line->hscroll = (uint32_t)(registers[13] & 0x3F) << 10 | (registers[11] & 3);
+}
+
+void vdp_resolve_cram(uint32_t *color_table, const uint16_t *cram, unsigned int start, unsigned int count) {
+	// shadow, normal and highlight copies of every CRAM entry
+	for (unsigned int i = start; i < start + count; ++i) {
+		uint8_t r = color_component(cram[i], 1);
+		uint8_t g = color_component(cram[i], 5);
+		uint8_t b = color_component(cram[i], 9);
+		color_table[i + 0] = rgba(r / 2, g / 2, b / 2);
+		color_table[i + 64] = rgba(r, g, b);
+		color_table[i + 128] = rgba(r / 2 + 128, g / 2 + 128, b / 2 + 128);
+	}
+}
+
+void vdp_resolve_tables(vdp_state_t *state, const vdp_native_t *native) {
+	const uint8_t *registers = native->registers;
+
+	// patterns are used as is
+	memcpy(state->pattern_table, native->vram, sizeof (state->pattern_table));
+
+	const uint32_t width = plane_size(registers[16] & 3);
+	const uint32_t height = plane_size(registers[16] >> 4 & 3);
+	const uint32_t bases[VDP_PLANE_COUNT] = {
+		(uint32_t)(registers[2] & 0x38) << 10,
+		(uint32_t)(registers[4] & 0x07) << 13,
+		(uint32_t)(registers[3] & 0x3C) << 10
+	};
+	for (int plane = 0; plane < VDP_PLANE_COUNT; ++plane) {
+		for (uint32_t i = 0; i < width * height; ++i) {
+			state->plane_table[plane][i / width][i % width] = vram_word(native, bases[plane] + i * 2);
+		}
+	}
+
+	const uint32_t sprite_base = (uint32_t)(registers[5] & 0x7E) << 9;
+	for (uint32_t i = 0; i < VDP_SPRITE_COUNT; ++i) {
+		for (uint32_t j = 0; j < 4; ++j) {
+			state->sprite_table[i][j] = vram_word(native, sprite_base + i * 8 + j * 2);
+		}
+	}
+
+	// the hscroll table layout may change mid-frame, lines past the display use the last one
+	for (uint32_t i = 0; i < VDP_HSCROLL_COUNT; ++i) {
+		uint32_t hscroll = state->lines[i < VDP_FRAMEBUFFER_HEIGHT ? i : VDP_FRAMEBUFFER_HEIGHT - 1].hscroll;
+		uint32_t mode = hscroll & 3;
+		uint32_t line = mode == 0 ? 0 : mode == 2 ? i & ~7u : i;
+		state->hscroll_table[VDP_PLANE_A][i] = vram_word(native, (hscroll & ~3u) + line * 4 + 0);
+		state->hscroll_table[VDP_PLANE_B][i] = vram_word(native, (hscroll & ~3u) + line * 4 + 2);
+	}
+
+	for (uint32_t i = 0; i < VDP_VSCROLL_COUNT; ++i) {
+		uint32_t column = (registers[11] & 4) ? i * 2 : 0;
+		state->vscroll_table[VDP_PLANE_A][i] = native->vsram[column + 0];
+		state->vscroll_table[VDP_PLANE_B][i] = native->vsram[column + 1];
+	}
+}
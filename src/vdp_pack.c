@@ -0,0 +1,118 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+#include "vdp_internal.h"
+#include <vdp_pack.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+struct vdp_pack {
+	uint8_t *data;
+	size_t size;
+	vdp_pack_header_t header;
+};
+
+static bool in_bounds(size_t size, uint32_t offset, uint64_t count, size_t element_size) {
+	return offset % 4 == 0 && offset <= size && count * element_size <= size - offset;
+}
+
+// Everything the accessors hand out is checked once here, a pack is never trusted blindly.
+static bool validate(const uint8_t *data, size_t size, const vdp_pack_header_t *header) {
+	if (!in_bounds(size, header->color_offset, header->color_count, sizeof (vdp_color_t)) ||
+		!in_bounds(size, header->pattern_offset, header->pattern_count, sizeof (uint32_t) * VDP_PATTERN_HEIGHT) ||
+		!in_bounds(size, header->map_offset, header->map_count, sizeof (vdp_pack_entry_t))) {
+		return false;
+	}
+	for (uint32_t i = 0; i < header->map_count; ++i) {
+		vdp_pack_entry_t entry;
+		memcpy(&entry, &data[header->map_offset + i * sizeof (entry)], sizeof (entry));
+		if (!in_bounds(size, entry.offset, (uint64_t)entry.width * entry.height, sizeof (vdp_cell_t))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+vdp_pack_t *vdp_open_pack(const char *path) {
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) || (size_t)st.st_size < sizeof (vdp_pack_header_t)) {
+		fprintf(stderr, "Unable to open pack '%s'.\n", path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return NULL;
+	}
+	void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	vdp_pack_header_t header;
+	if (data != MAP_FAILED) {
+		memcpy(&header, data, sizeof (header));
+	}
+	if (data == MAP_FAILED || memcmp(header.magic, "GVPK", 4) || header.version != VDP_PACK_VERSION || !validate(data, (size_t)st.st_size, &header)) {
+		fprintf(stderr, "'%s' is not a valid version %d VDP pack.\n", path, VDP_PACK_VERSION);
+		if (data != MAP_FAILED) {
+			munmap(data, (size_t)st.st_size);
+		}
+		return NULL;
+	}
+	vdp_pack_t *pack = calloc(1, sizeof (vdp_pack_t));
+	pack->data = data;
+	pack->size = (size_t)st.st_size;
+	pack->header = header;
+	return pack;
+}
+
+void vdp_close_pack(vdp_pack_t *pack) {
+	if (pack) {
+		munmap(pack->data, pack->size);
+		free(pack);
+	}
+}
+
+const vdp_color_t *vdp_get_pack_colors(const vdp_pack_t *pack, unsigned int *count) {
+	*count = pack->header.color_count;
+	return (const vdp_color_t *)&pack->data[pack->header.color_offset];
+}
+
+// Ready for vdp_set_patterns, count is in patterns.
+const uint32_t *vdp_get_pack_patterns(const vdp_pack_t *pack, unsigned int *count) {
+	*count = pack->header.pattern_count;
+	return (const uint32_t *)&pack->data[pack->header.pattern_offset];
+}
+
+// Maps are in input order, ready for vdp_set_cells.
+bool vdp_get_pack_map(const vdp_pack_t *pack, unsigned int index, vdp_pack_map_t *map) {
+	if (index >= pack->header.map_count) {
+		return false;
+	}
+	vdp_pack_entry_t entry;
+	memcpy(&entry, &pack->data[pack->header.map_offset + index * sizeof (entry)], sizeof (entry));
+	map->width = entry.width;
+	map->height = entry.height;
+	map->cells = (const vdp_cell_t *)&pack->data[entry.offset];
+	return true;
+}
@@ -0,0 +1,163 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "vdp_internal.h"
+
+#include <sched.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Single producer, single consumer ring of calls made on a queue context, replayed on the thread owning
+// the GL context. Records are a header, the arguments as 32 bit words and the payload copied inline,
+// padded to 8 bytes, so that the frame being recorded is its own arena: the span between two renders,
+// handed back to the producer call by call as the consumer gets through it. A record that does not fit
+// before the end of the ring is preceded by a wrap record. head and tail count bytes since creation, each
+// is only written by one side and published with release / acquire ordering, no lock is ever taken.
+
+enum {
+	QUEUE_MAX_ARGS = 8,
+	QUEUE_ALIGNMENT = 8,
+	QUEUE_DEFAULT_CAPACITY = 4 * 1024 * 1024,
+	QUEUE_CACHE_LINE = 64,
+	QUEUE_WRAP = 0xFF,
+};
+
+typedef struct queue_record {
+	uint8_t op;
+	uint8_t arg_count;
+	uint16_t reserved;
+	uint32_t size;
+} queue_record_t;
+
+struct vdp_queue {
+	uint8_t *data;
+	size_t capacity;
+	uint8_t head_padding[QUEUE_CACHE_LINE];
+	size_t head; // written by the producer
+	uint8_t tail_padding[QUEUE_CACHE_LINE];
+	size_t tail; // written by the consumer
+	uint8_t end_padding[QUEUE_CACHE_LINE];
+};
+
+static size_t record_length(unsigned int arg_count, size_t size) {
+	const size_t length = sizeof (queue_record_t) + arg_count * sizeof (uint32_t) + size;
+	return (length + QUEUE_ALIGNMENT - 1) & ~(size_t)(QUEUE_ALIGNMENT - 1);
+}
+
+vdp_queue_t *vdp_create_queue(size_t capacity) {
+	capacity = capacity ? (capacity + QUEUE_ALIGNMENT - 1) & ~(size_t)(QUEUE_ALIGNMENT - 1) : QUEUE_DEFAULT_CAPACITY;
+	vdp_queue_t *queue = calloc(1, sizeof (vdp_queue_t));
+	queue->data = malloc(capacity);
+	queue->capacity = capacity;
+	if (!queue->data) {
+		free(queue);
+		return NULL;
+	}
+	return queue;
+}
+
+void vdp_destroy_queue(vdp_queue_t *queue) {
+	if (queue) {
+		free(queue->data);
+		free(queue);
+	}
+}
+
+// Waits for the consumer when the ring is full, rendering is what the producer is waiting for so a yield
+// is enough.
+void vdp_queue_call(vdp_queue_t *queue, vdp_trace_op_t op, const void *data, unsigned int arg_count, ...) {
+	uint32_t args[QUEUE_MAX_ARGS];
+	va_list list;
+	va_start(list, arg_count);
+	for (unsigned int i = 0; i < arg_count; ++i) {
+		args[i] = va_arg(list, uint32_t);
+	}
+	va_end(list);
+	const size_t size = data ? vdp_trace_payload_size(op, args) : 0;
+	if (data && !size) {
+		return;
+	}
+	const size_t length = record_length(arg_count, size);
+	if (length > queue->capacity / 2) {
+		fprintf(stderr, "VDP call of %zu bytes does not fit a queue of %zu bytes.\n", length, queue->capacity);
+		return;
+	}
+
+	size_t head = queue->head;
+	const size_t offset = head % queue->capacity;
+	const size_t wrap = queue->capacity - offset < length ? queue->capacity - offset : 0;
+	while (queue->capacity - (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) < wrap + length) {
+		sched_yield();
+	}
+	if (wrap) {
+		const queue_record_t record = { QUEUE_WRAP, 0, 0, 0 };
+		memcpy(&queue->data[offset], &record, sizeof (record));
+		head += wrap;
+	}
+	uint8_t *out = &queue->data[head % queue->capacity];
+	const queue_record_t record = { (uint8_t)op, (uint8_t)arg_count, 0, (uint32_t)size };
+	memcpy(out, &record, sizeof (record));
+	memcpy(out + sizeof (record), args, arg_count * sizeof (uint32_t));
+	if (size) {
+		memcpy(out + sizeof (record) + arg_count * sizeof (uint32_t), data, size);
+	}
+	__atomic_store_n(&queue->head, head + length, __ATOMIC_RELEASE);
+}
+
+// Replays calls up to the next render, each record is handed back as soon as the call has copied its payload.
+// Returns false when the producer has not finished a frame yet, what it has recorded so far is applied already.
+bool vdp_run_queue(vdp_queue_t *queue, vdp_context_t *context) {
+	const size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	size_t tail = queue->tail;
+	bool rendered = false;
+	while (tail != head && !rendered) {
+		const uint8_t *in = &queue->data[tail % queue->capacity];
+		queue_record_t record;
+		memcpy(&record, in, sizeof (record));
+		if (record.op == QUEUE_WRAP) {
+			tail += queue->capacity - tail % queue->capacity;
+			__atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+			continue;
+		}
+		uint32_t args[QUEUE_MAX_ARGS];
+		memcpy(args, in + sizeof (record), record.arg_count * sizeof (uint32_t));
+		const void *data = record.size ? in + sizeof (record) + record.arg_count * sizeof (uint32_t) : NULL;
+		switch ((vdp_trace_op_t)record.op) {
+		case VDP_TRACE_RENDER:
+			vdp_render(context);
+			rendered = true;
+			break;
+		case VDP_TRACE_RENDER_TO:
+			vdp_render_to(context, args[0], args[1], args[2], args[3], args[4]);
+			rendered = true;
+			break;
+		case VDP_TRACE_BLIT:
+			vdp_blit(context, args[0], args[1], args[2], args[3], (vdp_filter_t)args[4]);
+			break;
+		default:
+			vdp_trace_apply(context, (vdp_trace_op_t)record.op, args, data);
+			break;
+		}
+		tail += record_length(record.arg_count, record.size);
+		__atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+	}
+	return rendered;
+}
@@ -0,0 +1,173 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "vdp_internal.h"
+
+#include <string.h>
+
+// Scalar transcription of vdp.fragment.glsl. Every function below mirrors its GLSL counterpart,
+// including the unsigned wrap-around arithmetic, so that the output is bit-exact with the GL path.
+
+static const uint32_t pattern_width = VDP_PATTERN_WIDTH;
+static const uint32_t pattern_height = VDP_PATTERN_HEIGHT;
+static const uint32_t priority_mask = 0x40;
+static const int max_sprite_count = 80;
+
+static inline uint32_t bitfield_extract(uint32_t value, int offset, int bits) {
+	return (value >> offset) & ((1u << bits) - 1);
+}
+
+static inline uint32_t flip(uint32_t p, uint32_t size, int dir) {
+	return dir ? size - 1 - p : p;
+}
+
+static uint32_t pattern_fetch(const vdp_state_t *state, uint32_t x, uint32_t y, uint32_t cell) {
+	uint32_t pattern = bitfield_extract(cell, 0, 11);
+	uint32_t palette = bitfield_extract(cell, 13, 3);
+	uint32_t strip = state->pattern_table[pattern][y & (pattern_height - 1)];
+	return palette * 16 + bitfield_extract(strip, (int)(x & (pattern_width - 1)) * 4 ^ 4, 4);
+}
+
+static uint32_t plane_fetch(const vdp_state_t *state, const vdp_line_t *line, uint32_t x, uint32_t y, unsigned int layer) {
+	uint32_t cell = state->plane_table[layer][y / pattern_height % line->plane_size[1]][x / pattern_width % line->plane_size[0]];
+	return pattern_fetch(state, flip(x, pattern_width, cell & 1u << 11), flip(y, pattern_height, cell & 1u << 12), cell);
+}
+
+static uint32_t sprite_fetch(const vdp_state_t *state, uint32_t x, uint32_t y) {
+	const uint16_t *entries = state->sprite_lines[y];
+	uint32_t color = 0;
+	for (uint32_t i = 1; i <= entries[0] && (color & 0xFu) == 0; ++i) {
+		const uint16_t *sprite = state->sprite_table[bitfield_extract(entries[i], 0, 7)];
+		uint32_t w = bitfield_extract(sprite[1], 10, 2) * 8 + 8;
+		uint32_t h = bitfield_extract(sprite[1], 8, 2) * 8 + 8;
+		uint32_t dx = x - sprite[3] + 128;
+		if (dx < bitfield_extract(entries[i], 8, 8)) {
+			uint32_t qx = flip(dx, w, sprite[2] & 1u << 11);
+			uint32_t qy = flip(y - sprite[0] + 128, h, sprite[2] & 1u << 12);
+			uint32_t cell = sprite[2] + (qy / pattern_height) + (qx / pattern_width) * (h / pattern_height);
+			color = pattern_fetch(state, qx, qy, cell);
+		}
+	}
+	return color;
+}
+
+static void scroll_fetch(const vdp_state_t *state, uint32_t x, uint32_t y, unsigned int layer, uint32_t *sx, uint32_t *sy) {
+	const uint32_t c = pattern_width * 2;
+	int column = (int)(x + ((-(uint32_t)state->hscroll_table[layer][y] + c - 1) & (c - 1)) + 1) / (int)c - 1;
+	*sx = -(uint32_t)state->hscroll_table[layer][y];
+	*sy = state->vscroll_table[layer][column > 0 ? column : 0];
+}
+
+static uint8_t pixel_fetch(const vdp_state_t *state, uint32_t x, uint32_t y) {
+	uint32_t scroll_ax, scroll_ay, scroll_bx, scroll_by;
+	scroll_fetch(state, x, y, 0, &scroll_ax, &scroll_ay);
+	scroll_fetch(state, x, y, 1, &scroll_bx, &scroll_by);
+	const vdp_line_t *line = &state->lines[y];
+	const int32_t *window = line->window;
+	int inside_window = (window[0] > 0 && x < (uint32_t)window[0]) || (window[0] < 0 && x >= (uint32_t)-window[0]) || (window[1] > 0 && y < (uint32_t)window[1]) || (window[1] < 0 && y >= (uint32_t)-window[1]);
+	uint32_t color_a = inside_window ? plane_fetch(state, line, x, y, VDP_PLANE_W) : plane_fetch(state, line, x + scroll_ax, y + scroll_ay, VDP_PLANE_A);
+	uint32_t color_b = plane_fetch(state, line, x + scroll_bx, y + scroll_by, VDP_PLANE_B);
+	uint32_t color_s = sprite_fetch(state, x, y);
+	uint32_t color = line->background_color;
+	uint32_t intensity = line->intensity_mode ? (color_a | color_b) & priority_mask : priority_mask;
+	if ((color_b & 0xF) != 0) {
+		color = color_b;
+	}
+	if ((color_a & 0xF) != 0 && (color_a & priority_mask) >= (color & priority_mask)) {
+		color = color_a;
+	}
+	if ((color_s & 0xF) != 0 && (color_s & priority_mask) >= (color & priority_mask)) {
+		if (line->intensity_mode) {
+			if ((color_s & 0x3F) == 0x3E) {
+				intensity += priority_mask;
+			} else if ((color_s & 0x3F) == 0x3F) {
+				intensity = 0;
+			} else {
+				color = color_s;
+				intensity |= (color & 0xF) == 0xE ? priority_mask : color & priority_mask; // Emulate S&H color 14 bug...
+			}
+		} else {
+			color = color_s;
+		}
+	}
+	return (uint8_t)((color & 0x3F) | intensity);
+}
+
+void vdp_build_sprite_lines(vdp_state_t *state) {
+	for (uint32_t y = 0; y < VDP_FRAMEBUFFER_HEIGHT; ++y) {
+		uint16_t *entries = state->sprite_lines[y];
+		uint32_t count = 0;
+		uint32_t cells = 0;
+		int i = 0;
+		int link = 0;
+		do {
+			const uint16_t *sprite = state->sprite_table[link];
+			uint32_t index = (uint32_t)link;
+			link = (int)bitfield_extract(sprite[1], 0, 7);
+			if (y - sprite[0] + 128 < bitfield_extract(sprite[1], 8, 2) * 8 + 8) {
+				if (count == VDP_LINE_SPRITE_COUNT) {
+					break;
+				}
+				// the sprite that overflows the cell budget keeps its leftmost cells
+				uint32_t width = bitfield_extract(sprite[1], 10, 2) + 1;
+				if (width > VDP_LINE_SPRITE_CELLS - cells) {
+					width = VDP_LINE_SPRITE_CELLS - cells;
+				}
+				entries[++count] = (uint16_t)(index | width * 8 << 8);
+				cells += width;
+				if (cells == VDP_LINE_SPRITE_CELLS) {
+					break;
+				}
+			}
+		} while (++i < max_sprite_count && link != 0);
+		entries[0] = (uint16_t)count;
+	}
+}
+
+void vdp_output_line(const vdp_state_t *state, uint32_t y, const uint8_t *index, vdp_format_t format, void *pixels) {
+	const uint32_t *colors = state->color_table[state->lines[y].palette];
+	if (format == VDP_FORMAT_INDEX8) {
+		memcpy((uint8_t *)pixels + y * VDP_FRAMEBUFFER_WIDTH, index, VDP_FRAMEBUFFER_WIDTH);
+	} else if (format == VDP_FORMAT_RGB565) {
+		// rounds like the GL conversion of normalized colors
+		uint16_t *line = (uint16_t *)pixels + y * VDP_FRAMEBUFFER_WIDTH;
+		for (uint32_t x = 0; x < VDP_FRAMEBUFFER_WIDTH; ++x) {
+			const uint32_t color = colors[index[x]];
+			const uint32_t r = ((color & 0xFF) * 31 + 127) / 255;
+			const uint32_t g = ((color >> 8 & 0xFF) * 63 + 127) / 255;
+			const uint32_t b = ((color >> 16 & 0xFF) * 31 + 127) / 255;
+			line[x] = (uint16_t)(r << 11 | g << 5 | b);
+		}
+	} else {
+		uint32_t *line = (uint32_t *)pixels + y * VDP_FRAMEBUFFER_WIDTH;
+		for (uint32_t x = 0; x < VDP_FRAMEBUFFER_WIDTH; ++x) {
+			line[x] = colors[index[x]];
+		}
+	}
+}
+
+void vdp_render_reference(const vdp_state_t *state, vdp_format_t format, void *pixels) {
+	uint8_t index[VDP_FRAMEBUFFER_WIDTH];
+	for (uint32_t y = 0; y < VDP_FRAMEBUFFER_HEIGHT; ++y) {
+		for (uint32_t x = 0; x < VDP_FRAMEBUFFER_WIDTH; ++x) {
+			index[x] = pixel_fetch(state, x, y);
+		}
+		vdp_output_line(state, y, index, format, pixels);
+	}
+}
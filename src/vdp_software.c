@@ -0,0 +1,357 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "vdp_internal.h"
+
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Scanline renderer producing the same output as vdp_reference.c. Each line is built as three byte
+// buffers (plane A/W, plane B, sprites) holding palette * 16 + index, one 8-pixel strip at a time,
+// then composited with SIMD and resolved through the color table. Lines are grouped in bands that
+// the calling thread and the worker pool pull from a shared counter.
+
+enum {
+	LINE_PADDING = VDP_PATTERN_WIDTH,
+	LINE_SIZE = LINE_PADDING + VDP_FRAMEBUFFER_WIDTH + LINE_PADDING,
+	BAND_HEIGHT = 8,
+	BAND_COUNT = VDP_FRAMEBUFFER_HEIGHT / BAND_HEIGHT,
+};
+
+struct vdp_software {
+	pthread_mutex_t mutex;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	pthread_t *threads;
+	unsigned int thread_count;
+	unsigned int generation;
+	unsigned int busy;
+	int quit;
+	const vdp_state_t *state;
+	vdp_format_t format;
+	void *pixels;
+	unsigned int next_band;
+};
+
+static inline uint32_t reverse_strip(uint32_t strip) {
+	strip = strip >> 24 | (strip >> 8 & 0xFF00u) | (strip << 8 & 0xFF0000u) | strip << 24;
+	return (strip >> 4 & 0x0F0F0F0Fu) | (strip & 0x0F0F0F0Fu) << 4;
+}
+
+// Expands a 4bpp strip (pixel 2k in the high nibble of byte k) into eight palette * 16 + index bytes.
+static inline void decode_strip(uint8_t *dst, uint32_t strip, uint32_t cell) {
+	uint8_t attr = (uint8_t)((cell >> 13 & 7) * 16);
+#if defined(__SSE2__)
+	__m128i v = _mm_cvtsi32_si128((int)strip);
+	__m128i m = _mm_set1_epi8(0x0F);
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), m);
+	__m128i lo = _mm_and_si128(v, m);
+	_mm_storel_epi64((__m128i *)dst, _mm_or_si128(_mm_unpacklo_epi8(hi, lo), _mm_set1_epi8((char)attr)));
+#else
+	for (unsigned int i = 0; i < 4; ++i) {
+		dst[i * 2 + 0] = attr | (strip >> (i * 8 + 4) & 0xF);
+		dst[i * 2 + 1] = attr | (strip >> (i * 8 + 0) & 0xF);
+	}
+#endif
+}
+
+// Copies the strip pixels over the transparent pixels of dst, so that the first opaque sprite wins.
+static inline void merge_strip(uint8_t *dst, const uint8_t *src) {
+#if defined(__SSE2__)
+	__m128i d = _mm_loadl_epi64((const __m128i *)dst);
+	__m128i s = _mm_loadl_epi64((const __m128i *)src);
+	__m128i empty = _mm_cmpeq_epi8(_mm_and_si128(d, _mm_set1_epi8(0x0F)), _mm_setzero_si128());
+	_mm_storel_epi64((__m128i *)dst, _mm_or_si128(_mm_and_si128(empty, s), _mm_andnot_si128(empty, d)));
+#else
+	for (unsigned int i = 0; i < VDP_PATTERN_WIDTH; ++i) {
+		if ((dst[i] & 0xF) == 0) {
+			dst[i] = src[i];
+		}
+	}
+#endif
+}
+
+static void plane_line(const vdp_state_t *state, unsigned int layer, uint32_t y, uint8_t *line, int from, int to) {
+	const uint32_t *plane_size = state->lines[y].plane_size;
+	uint32_t sx = 0;
+	uint32_t r = 0;
+	if (layer != VDP_PLANE_W) {
+		sx = -(uint32_t)state->hscroll_table[layer][y];
+		r = (sx + 15) & 15;
+	}
+	for (int x = from - (int)((from + sx) & 7); x < to; x += VDP_PATTERN_WIDTH) {
+		uint32_t px = (uint32_t)x + sx;
+		uint32_t py = y;
+		if (layer != VDP_PLANE_W) {
+			int column = (int)((uint32_t)(x < 0 ? 0 : x) + r + 1) / 16 - 1;
+			py += state->vscroll_table[layer][column > 0 ? column : 0];
+		}
+		uint32_t cell = state->plane_table[layer][py / VDP_PATTERN_HEIGHT % plane_size[1]][px / VDP_PATTERN_WIDTH % plane_size[0]];
+		uint32_t row = (cell & 1u << 12) ? ~py & 7 : py & 7;
+		uint32_t strip = state->pattern_table[cell & 0x7FF][row];
+		decode_strip(&line[LINE_PADDING + x], (cell & 1u << 11) ? reverse_strip(strip) : strip, cell);
+	}
+}
+
+static void sprite_line(const vdp_state_t *state, uint32_t y, uint8_t *line) {
+	uint8_t strip[VDP_PATTERN_WIDTH];
+	const uint16_t *entries = state->sprite_lines[y];
+	memset(line, 0, LINE_SIZE);
+	for (uint32_t i = 1; i <= entries[0]; ++i) {
+		const uint16_t *sprite = state->sprite_table[entries[i] & 0x7F];
+		uint32_t w = (sprite[1] >> 10 & 3) * 8 + 8;
+		uint32_t h = (sprite[1] >> 8 & 3) * 8 + 8;
+		uint32_t qy = y - sprite[0] + 128;
+		if (sprite[2] & 1u << 12) {
+			qy = h - 1 - qy;
+		}
+		// only the visible width is drawn, always a whole number of cells
+		for (uint32_t qx = 0; qx < (uint32_t)(entries[i] >> 8); qx += VDP_PATTERN_WIDTH) {
+			int x = (int)sprite[3] - 128 + (int)qx;
+			if (x <= -VDP_PATTERN_WIDTH || x >= VDP_FRAMEBUFFER_WIDTH) {
+				continue;
+			}
+			uint32_t column = (sprite[2] & 1u << 11) ? w - VDP_PATTERN_WIDTH - qx : qx;
+			uint32_t cell = sprite[2] + qy / VDP_PATTERN_HEIGHT + column / VDP_PATTERN_WIDTH * (h / VDP_PATTERN_HEIGHT);
+			uint32_t bits = state->pattern_table[cell & 0x7FF][qy & 7];
+			decode_strip(strip, (sprite[2] & 1u << 11) ? reverse_strip(bits) : bits, cell);
+			merge_strip(&line[LINE_PADDING + x], strip);
+		}
+	}
+}
+
+#if defined(__AVX2__)
+typedef __m256i vec_t;
+#define VEC_SIZE 32
+#define vec_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define vec_store(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#define vec_set1(c) _mm256_set1_epi8((char)(c))
+#define vec_and _mm256_and_si256
+#define vec_or _mm256_or_si256
+#define vec_andnot _mm256_andnot_si256
+#define vec_cmpeq _mm256_cmpeq_epi8
+#define vec_add _mm256_add_epi8
+#elif defined(__SSE2__)
+typedef __m128i vec_t;
+#define VEC_SIZE 16
+#define vec_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define vec_store(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define vec_set1(c) _mm_set1_epi8((char)(c))
+#define vec_and _mm_and_si128
+#define vec_or _mm_or_si128
+#define vec_andnot _mm_andnot_si128
+#define vec_cmpeq _mm_cmpeq_epi8
+#define vec_add _mm_add_epi8
+#endif
+
+// Priority and shadow/highlight resolution of main() in vdp.fragment.glsl, producing color table indices.
+static void composite_line(const vdp_line_t *line, const uint8_t *a, const uint8_t *b, const uint8_t *s, uint8_t *index) {
+	uint8_t background = (uint8_t)line->background_color;
+#if defined(VEC_SIZE)
+	const vec_t zero = vec_set1(0);
+	const vec_t ones = vec_set1(0xFF);
+	const vec_t m0f = vec_set1(0x0F);
+	const vec_t m3f = vec_set1(0x3F);
+	const vec_t m40 = vec_set1(0x40);
+	for (unsigned int x = 0; x < VDP_FRAMEBUFFER_WIDTH; x += VEC_SIZE) {
+		vec_t va = vec_load(&a[x]);
+		vec_t vb = vec_load(&b[x]);
+		vec_t vs = vec_load(&s[x]);
+		vec_t color = vec_set1(background);
+		vec_t opaque = vec_andnot(vec_cmpeq(vec_and(vb, m0f), zero), ones);
+		color = vec_or(vec_and(opaque, vb), vec_andnot(opaque, color));
+		opaque = vec_andnot(vec_or(vec_cmpeq(vec_and(va, m0f), zero), vec_cmpeq(vec_and(vec_andnot(va, color), m40), m40)), ones);
+		color = vec_or(vec_and(opaque, va), vec_andnot(opaque, color));
+		opaque = vec_andnot(vec_or(vec_cmpeq(vec_and(vs, m0f), zero), vec_cmpeq(vec_and(vec_andnot(vs, color), m40), m40)), ones);
+		vec_t intensity;
+		if (line->intensity_mode) {
+			intensity = vec_and(vec_or(va, vb), m40);
+			vec_t shadow = vec_and(vec_cmpeq(vec_and(vs, m3f), m3f), opaque);
+			vec_t highlight = vec_and(vec_cmpeq(vec_and(vs, m3f), vec_set1(0x3E)), opaque);
+			vec_t sprite = vec_andnot(vec_or(shadow, highlight), opaque);
+			intensity = vec_andnot(shadow, vec_add(intensity, vec_and(highlight, m40)));
+			color = vec_or(vec_and(sprite, vs), vec_andnot(sprite, color));
+			vec_t bug = vec_cmpeq(vec_and(vs, m0f), vec_set1(0x0E));
+			intensity = vec_or(intensity, vec_and(sprite, vec_or(vec_and(bug, m40), vec_andnot(bug, vec_and(vs, m40)))));
+		} else {
+			intensity = m40;
+			color = vec_or(vec_and(opaque, vs), vec_andnot(opaque, color));
+		}
+		vec_store(&index[x], vec_or(vec_and(color, m3f), intensity));
+	}
+#else
+	for (unsigned int x = 0; x < VDP_FRAMEBUFFER_WIDTH; ++x) {
+		uint8_t color = background;
+		uint8_t intensity = line->intensity_mode ? (a[x] | b[x]) & 0x40 : 0x40;
+		if ((b[x] & 0xF) != 0) {
+			color = b[x];
+		}
+		if ((a[x] & 0xF) != 0 && (a[x] & 0x40) >= (color & 0x40)) {
+			color = a[x];
+		}
+		if ((s[x] & 0xF) != 0 && (s[x] & 0x40) >= (color & 0x40)) {
+			if (line->intensity_mode) {
+				if ((s[x] & 0x3F) == 0x3E) {
+					intensity += 0x40;
+				} else if ((s[x] & 0x3F) == 0x3F) {
+					intensity = 0;
+				} else {
+					color = s[x];
+					intensity |= (color & 0xF) == 0xE ? 0x40 : color & 0x40;
+				}
+			} else {
+				color = s[x];
+			}
+		}
+		index[x] = (color & 0x3F) | intensity;
+	}
+#endif
+}
+
+static void render_line(const vdp_state_t *state, uint32_t y, vdp_format_t format, void *pixels) {
+	uint8_t line_a[LINE_SIZE];
+	uint8_t line_b[LINE_SIZE];
+	uint8_t line_s[LINE_SIZE];
+	uint8_t line_w[LINE_SIZE];
+	uint8_t index[VDP_FRAMEBUFFER_WIDTH];
+
+	const vdp_line_t *line = &state->lines[y];
+	const int32_t *window = line->window;
+	int from = 0;
+	int to = 0;
+	if ((window[1] > 0 && y < (uint32_t)window[1]) || (window[1] < 0 && y >= (uint32_t)-window[1])) {
+		to = VDP_FRAMEBUFFER_WIDTH;
+	} else if (window[0] > 0) {
+		to = window[0] < VDP_FRAMEBUFFER_WIDTH ? window[0] : VDP_FRAMEBUFFER_WIDTH;
+	} else if (window[0] < 0) {
+		from = -window[0] < VDP_FRAMEBUFFER_WIDTH ? -window[0] : VDP_FRAMEBUFFER_WIDTH;
+		to = VDP_FRAMEBUFFER_WIDTH;
+	}
+
+	if (from > 0 || to < VDP_FRAMEBUFFER_WIDTH) {
+		plane_line(state, VDP_PLANE_A, y, line_a, 0, VDP_FRAMEBUFFER_WIDTH);
+	}
+	if (from < to) {
+		plane_line(state, VDP_PLANE_W, y, line_w, from, to);
+		memcpy(&line_a[LINE_PADDING + from], &line_w[LINE_PADDING + from], (size_t)(to - from));
+	}
+	plane_line(state, VDP_PLANE_B, y, line_b, 0, VDP_FRAMEBUFFER_WIDTH);
+	sprite_line(state, y, line_s);
+	composite_line(line, &line_a[LINE_PADDING], &line_b[LINE_PADDING], &line_s[LINE_PADDING], index);
+	vdp_output_line(state, y, index, format, pixels);
+}
+
+static void render_bands(vdp_software_t *software) {
+	unsigned int band;
+	while ((band = __atomic_fetch_add(&software->next_band, 1, __ATOMIC_RELAXED)) < BAND_COUNT) {
+		for (uint32_t y = band * BAND_HEIGHT; y < (band + 1) * BAND_HEIGHT; ++y) {
+			render_line(software->state, y, software->format, software->pixels);
+		}
+	}
+}
+
+static void *worker_main(void *arg) {
+	vdp_software_t *software = arg;
+	unsigned int generation = 0;
+	pthread_mutex_lock(&software->mutex);
+	for (;;) {
+		while (software->generation == generation && !software->quit) {
+			pthread_cond_wait(&software->start_cond, &software->mutex);
+		}
+		if (software->quit) {
+			break;
+		}
+		generation = software->generation;
+		pthread_mutex_unlock(&software->mutex);
+		render_bands(software);
+		pthread_mutex_lock(&software->mutex);
+		if (--software->busy == 0) {
+			pthread_cond_signal(&software->done_cond);
+		}
+	}
+	pthread_mutex_unlock(&software->mutex);
+	return NULL;
+}
+
+vdp_software_t *vdp_create_software(unsigned int thread_count) {
+	if (thread_count == 0) {
+		long count = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_count = count > 0 ? (unsigned int)count : 1;
+	}
+	if (thread_count > BAND_COUNT) {
+		thread_count = BAND_COUNT;
+	}
+	vdp_software_t *software = calloc(1, sizeof (vdp_software_t));
+	pthread_mutex_init(&software->mutex, NULL);
+	pthread_cond_init(&software->start_cond, NULL);
+	pthread_cond_init(&software->done_cond, NULL);
+	software->threads = calloc(thread_count, sizeof (pthread_t));
+	// the calling thread renders too, so only thread_count - 1 workers are spawned
+	for (unsigned int i = 1; i < thread_count; ++i) {
+		if (pthread_create(&software->threads[software->thread_count], NULL, worker_main, software) == 0) {
+			++software->thread_count;
+		}
+	}
+	return software;
+}
+
+void vdp_destroy_software(vdp_software_t *software) {
+	if (software) {
+		pthread_mutex_lock(&software->mutex);
+		software->quit = 1;
+		pthread_cond_broadcast(&software->start_cond);
+		pthread_mutex_unlock(&software->mutex);
+		for (unsigned int i = 0; i < software->thread_count; ++i) {
+			pthread_join(software->threads[i], NULL);
+		}
+		pthread_cond_destroy(&software->done_cond);
+		pthread_cond_destroy(&software->start_cond);
+		pthread_mutex_destroy(&software->mutex);
+		free(software->threads);
+		free(software);
+	}
+}
+
+void vdp_render_software(vdp_software_t *software, const vdp_state_t *state, vdp_format_t format, void *pixels) {
+	pthread_mutex_lock(&software->mutex);
+	software->state = state;
+	software->format = format;
+	software->pixels = pixels;
+	software->next_band = 0;
+	software->busy = software->thread_count;
+	++software->generation;
+	pthread_cond_broadcast(&software->start_cond);
+	pthread_mutex_unlock(&software->mutex);
+
+	render_bands(software);
+
+	pthread_mutex_lock(&software->mutex);
+	while (software->busy > 0) {
+		pthread_cond_wait(&software->done_cond, &software->mutex);
+	}
+	pthread_mutex_unlock(&software->mutex);
+}
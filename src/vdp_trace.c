@@ -0,0 +1,455 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "vdp_internal.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// A trace is a "GVDT" header followed by 4 byte aligned records: op, argument count and payload size,
+// the arguments as 32 bit words, then the payload. Payloads are coded against a mirror of everything
+// written so far by the same call, as (uint16 skip, uint16 copy) pairs each followed by copy new bytes.
+// Render and blit records end with the time elapsed since the start of the trace in nanoseconds.
+
+enum {
+	TRACE_VERSION = 1,
+	TRACE_MAX_ARGS = 8,
+	TRACE_MAX_RUN = 0xFFFF,
+	TRACE_MIN_SKIP = 4,
+};
+
+typedef struct trace_header {
+	char magic[4];
+	uint32_t version;
+} trace_header_t;
+
+typedef struct trace_record {
+	uint8_t op;
+	uint8_t arg_count;
+	uint16_t reserved;
+	uint32_t size;
+} trace_record_t;
+
+// Last payload of every call, the reference that payloads are coded against.
+typedef struct trace_mirror {
+	vdp_color_t colors[VDP_COLOR_COUNT * 4];
+	vdp_color_t colors_sh[VDP_COLOR_COUNT];
+	uint32_t patterns[VDP_PATTERN_COUNT][VDP_PATTERN_HEIGHT];
+	vdp_sprite_t sprites[VDP_SPRITE_COUNT];
+	vdp_cell_t cells[VDP_PLANE_COUNT][VDP_PLANE_MAX_HEIGHT][VDP_PLANE_MAX_WIDTH];
+	uint16_t hscroll[2][VDP_HSCROLL_COUNT];
+	uint16_t vscroll[2][VDP_VSCROLL_COUNT];
+	uint8_t vram[VDP_VRAM_SIZE];
+	uint16_t cram[VDP_CRAM_COUNT];
+	uint16_t vsram[VDP_VSRAM_COUNT];
+	uint8_t registers[VDP_REGISTER_COUNT];
+} trace_mirror_t;
+
+// Payload of a call: rows of row_size bytes, stride bytes apart in the mirror.
+typedef struct trace_target {
+	uint8_t *base;
+	size_t stride;
+	size_t row_size;
+	unsigned int rows;
+} trace_target_t;
+
+struct vdp_trace {
+	FILE *file;
+	struct timespec start;
+	trace_mirror_t mirror;
+	uint8_t *buffer;
+	size_t capacity;
+};
+
+struct vdp_replay {
+	uint8_t *data;
+	size_t size;
+	size_t offset;
+	trace_mirror_t mirror;
+	uint8_t *buffer;
+	size_t capacity;
+};
+
+static const trace_header_t header = { { 'G', 'V', 'D', 'T' }, TRACE_VERSION };
+
+// Locates the payload of a call in the mirror, false when the call carries none or would be rejected.
+static bool trace_target(trace_mirror_t *mirror, vdp_trace_op_t op, const uint32_t *args, trace_target_t *target) {
+	uint8_t *base;
+	size_t element_size;
+	unsigned int capacity;
+	target->rows = 1;
+	switch (op) {
+	case VDP_TRACE_COLORS:
+		base = (uint8_t *)mirror->colors;
+		element_size = sizeof (mirror->colors[0]);
+		capacity = VDP_COLOR_COUNT * 4;
+		break;
+	case VDP_TRACE_COLORS_SH:
+		base = (uint8_t *)mirror->colors_sh;
+		element_size = sizeof (mirror->colors_sh[0]);
+		capacity = VDP_COLOR_COUNT;
+		break;
+	case VDP_TRACE_PATTERNS:
+		base = (uint8_t *)mirror->patterns;
+		element_size = sizeof (mirror->patterns[0]);
+		capacity = VDP_PATTERN_COUNT;
+		break;
+	case VDP_TRACE_SPRITES:
+		base = (uint8_t *)mirror->sprites;
+		element_size = sizeof (mirror->sprites[0]);
+		capacity = VDP_SPRITE_COUNT;
+		break;
+	case VDP_TRACE_HSCROLL:
+	case VDP_TRACE_VSCROLL:
+		if (args[0] > VDP_PLANE_B) {
+			return false;
+		}
+		base = op == VDP_TRACE_HSCROLL ? (uint8_t *)mirror->hscroll[args[0]] : (uint8_t *)mirror->vscroll[args[0]];
+		element_size = sizeof (uint16_t);
+		capacity = op == VDP_TRACE_HSCROLL ? VDP_HSCROLL_COUNT : VDP_VSCROLL_COUNT;
+		++args;
+		break;
+	case VDP_TRACE_VRAM:
+		base = mirror->vram;
+		element_size = sizeof (mirror->vram[0]);
+		capacity = VDP_VRAM_SIZE;
+		break;
+	case VDP_TRACE_CRAM:
+		base = (uint8_t *)mirror->cram;
+		element_size = sizeof (mirror->cram[0]);
+		capacity = VDP_CRAM_COUNT;
+		break;
+	case VDP_TRACE_VSRAM:
+		base = (uint8_t *)mirror->vsram;
+		element_size = sizeof (mirror->vsram[0]);
+		capacity = VDP_VSRAM_COUNT;
+		break;
+	case VDP_TRACE_REGISTERS:
+		base = mirror->registers;
+		element_size = sizeof (mirror->registers[0]);
+		capacity = VDP_REGISTER_COUNT;
+		break;
+	case VDP_TRACE_CELLS:
+		// plane, x, y, width, height
+		if (args[0] >= VDP_PLANE_COUNT || args[1] > VDP_PLANE_MAX_WIDTH || args[3] > VDP_PLANE_MAX_WIDTH - args[1] || args[2] > VDP_PLANE_MAX_HEIGHT || args[4] > VDP_PLANE_MAX_HEIGHT - args[2]) {
+			return false;
+		}
+		target->base = (uint8_t *)&mirror->cells[args[0]][args[2]][args[1]];
+		target->stride = sizeof (mirror->cells[0][0]);
+		target->row_size = args[3] * sizeof (vdp_cell_t);
+		target->rows = args[4];
+		return true;
+	default:
+		return false;
+	}
+	// start, count
+	if (args[0] > capacity || args[1] > capacity - args[0]) {
+		return false;
+	}
+	target->base = base + args[0] * element_size;
+	target->stride = args[1] * element_size;
+	target->row_size = args[1] * element_size;
+	return true;
+}
+
+static uint8_t *reserve(uint8_t **buffer, size_t *capacity, size_t size) {
+	if (size > *capacity) {
+		*capacity = size;
+		*buffer = realloc(*buffer, size);
+	}
+	return *buffer;
+}
+
+static void gather(const trace_target_t *target, uint8_t *data) {
+	for (unsigned int j = 0; j < target->rows; ++j) {
+		memcpy(&data[j * target->row_size], &target->base[j * target->stride], target->row_size);
+	}
+}
+
+static void scatter(const trace_target_t *target, const uint8_t *data) {
+	for (unsigned int j = 0; j < target->rows; ++j) {
+		memcpy(&target->base[j * target->stride], &data[j * target->row_size], target->row_size);
+	}
+}
+
+static size_t put_run(uint8_t *out, size_t skip, const uint8_t *data, size_t copy) {
+	const uint16_t run[2] = { (uint16_t)skip, (uint16_t)copy };
+	memcpy(out, run, sizeof (run));
+	memcpy(out + sizeof (run), data, copy);
+	return sizeof (run) + copy;
+}
+
+// Codes data against old, every run but the first and the overlong ones skips at least TRACE_MIN_SKIP
+// bytes so out never needs more than 2 * size + 4 bytes.
+static size_t encode(const uint8_t *old, const uint8_t *data, size_t size, uint8_t *out) {
+	size_t length = 0;
+	size_t i = 0;
+	while (i < size) {
+		size_t skip = 0;
+		while (i + skip < size && skip < TRACE_MAX_RUN && old[i + skip] == data[i + skip]) {
+			++skip;
+		}
+		size_t copy = 0;
+		size_t same = 0;
+		while (i + skip + copy + same < size && copy + same < TRACE_MAX_RUN && same < TRACE_MIN_SKIP) {
+			if (old[i + skip + copy + same] == data[i + skip + copy + same]) {
+				++same;
+			} else {
+				copy += same + 1;
+				same = 0;
+			}
+		}
+		if (i + skip == size) {
+			break;
+		}
+		length += put_run(&out[length], skip, &data[i + skip], copy);
+		i += skip + copy;
+	}
+	return length;
+}
+
+static bool decode(const uint8_t *in, size_t length, uint8_t *data, size_t size) {
+	size_t i = 0;
+	size_t j = 0;
+	while (j + sizeof (uint16_t) * 2 <= length) {
+		uint16_t run[2];
+		memcpy(run, &in[j], sizeof (run));
+		j += sizeof (run);
+		if (i + run[0] + run[1] > size || j + run[1] > length) {
+			return false;
+		}
+		memcpy(&data[i + run[0]], &in[j], run[1]);
+		i += run[0] + run[1];
+		j += run[1];
+	}
+	return j == length;
+}
+
+vdp_trace_t *vdp_create_trace(const char *path) {
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		fprintf(stderr, "Unable to create trace '%s'.\n", path);
+		return NULL;
+	}
+	vdp_trace_t *trace = calloc(1, sizeof (vdp_trace_t));
+	trace->file = file;
+	clock_gettime(CLOCK_MONOTONIC, &trace->start);
+	fwrite(&header, sizeof (header), 1, file);
+	return trace;
+}
+
+void vdp_destroy_trace(vdp_trace_t *trace) {
+	if (trace) {
+		fclose(trace->file);
+		free(trace->buffer);
+		free(trace);
+	}
+}
+
+void vdp_trace_call(vdp_trace_t *trace, vdp_trace_op_t op, const void *data, unsigned int arg_count, ...) {
+	uint32_t args[TRACE_MAX_ARGS];
+	va_list list;
+	va_start(list, arg_count);
+	for (unsigned int i = 0; i < arg_count; ++i) {
+		args[i] = va_arg(list, uint32_t);
+	}
+	va_end(list);
+	if (op == VDP_TRACE_RENDER || op == VDP_TRACE_BLIT || op == VDP_TRACE_RENDER_TO) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		const uint64_t time = (uint64_t)(now.tv_sec - trace->start.tv_sec) * 1000000000u + (uint64_t)(now.tv_nsec - trace->start.tv_nsec);
+		args[arg_count++] = (uint32_t)time;
+		args[arg_count++] = (uint32_t)(time >> 32);
+	}
+
+	trace_target_t target;
+	size_t length = 0;
+	if (data && trace_target(&trace->mirror, op, args, &target)) {
+		const size_t size = target.row_size * target.rows;
+		uint8_t *buffer = reserve(&trace->buffer, &trace->capacity, size * 3 + 4);
+		gather(&target, buffer);
+		length = encode(buffer, data, size, &buffer[size]);
+		scatter(&target, data);
+		memmove(buffer, &buffer[size], length);
+	} else if (data) {
+		return;
+	}
+
+	static const uint8_t padding[3] = { 0 };
+	const trace_record_t record = { (uint8_t)op, (uint8_t)arg_count, 0, (uint32_t)length };
+	fwrite(&record, sizeof (record), 1, trace->file);
+	fwrite(args, sizeof (uint32_t), arg_count, trace->file);
+	fwrite(trace->buffer, 1, length, trace->file);
+	fwrite(padding, 1, (4 - length % 4) % 4, trace->file);
+}
+
+vdp_replay_t *vdp_open_replay(const char *path) {
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) || (size_t)st.st_size < sizeof (header)) {
+		fprintf(stderr, "Unable to open trace '%s'.\n", path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return NULL;
+	}
+	void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED || memcmp(data, &header, sizeof (header))) {
+		fprintf(stderr, "'%s' is not a version %d VDP trace.\n", path, TRACE_VERSION);
+		if (data != MAP_FAILED) {
+			munmap(data, (size_t)st.st_size);
+		}
+		return NULL;
+	}
+	vdp_replay_t *replay = calloc(1, sizeof (vdp_replay_t));
+	replay->data = data;
+	replay->size = (size_t)st.st_size;
+	replay->offset = sizeof (header);
+	return replay;
+}
+
+void vdp_close_replay(vdp_replay_t *replay) {
+	if (replay) {
+		munmap(replay->data, replay->size);
+		free(replay->buffer);
+		free(replay);
+	}
+}
+
+void vdp_rewind_replay(vdp_replay_t *replay) {
+	replay->offset = sizeof (header);
+	memset(&replay->mirror, 0, sizeof (replay->mirror));
+}
+
+size_t vdp_trace_payload_size(vdp_trace_op_t op, const uint32_t *args) {
+	static trace_mirror_t layout; // only addresses are computed, nothing is read or written
+	trace_target_t target;
+	return trace_target(&layout, op, args, &target) ? target.row_size * target.rows : 0;
+}
+
+void vdp_trace_apply(vdp_context_t *context, vdp_trace_op_t op, const uint32_t *args, const void *data) {
+	switch (op) {
+	case VDP_TRACE_LINE:
+		vdp_set_line(context, args[0]);
+		break;
+	case VDP_TRACE_MODE:
+		vdp_set_mode(context, (vdp_mode_t)args[0]);
+		break;
+	case VDP_TRACE_BACKGROUND_COLOR:
+		vdp_set_background_color(context, args[0]);
+		break;
+	case VDP_TRACE_PLANE_SIZE:
+		vdp_set_plane_size(context, args[0], args[1]);
+		break;
+	case VDP_TRACE_WINDOW_COORD:
+		vdp_set_window_coord(context, (int32_t)args[0], (int32_t)args[1]);
+		break;
+	case VDP_TRACE_BEGIN_UPDATE:
+		vdp_begin_update(context);
+		break;
+	case VDP_TRACE_COMMIT_UPDATE:
+		vdp_commit_update(context);
+		break;
+	case VDP_TRACE_COLORS:
+		vdp_set_colors(context, args[0], args[1], data);
+		break;
+	case VDP_TRACE_COLORS_SH:
+		vdp_set_colors_sh(context, args[0], args[1], data);
+		break;
+	case VDP_TRACE_PATTERNS:
+		vdp_set_patterns(context, args[0], args[1], data);
+		break;
+	case VDP_TRACE_SPRITES:
+		vdp_set_sprites(context, args[0], args[1], data);
+		break;
+	case VDP_TRACE_CELLS:
+		vdp_set_cells(context, (vdp_plane_t)args[0], args[1], args[2], args[3], args[4], data);
+		break;
+	case VDP_TRACE_HSCROLL:
+		vdp_set_hscroll(context, (vdp_plane_t)args[0], args[1], args[2], data);
+		break;
+	case VDP_TRACE_VSCROLL:
+		vdp_set_vscroll(context, (vdp_plane_t)args[0], args[1], args[2], data);
+		break;
+	case VDP_TRACE_VRAM:
+		vdp_set_vram(context, args[0], args[1], data);
+		break;
+	case VDP_TRACE_CRAM:
+		vdp_set_cram(context, args[0], args[1], data);
+		break;
+	case VDP_TRACE_VSRAM:
+		vdp_set_vsram(context, args[0], args[1], data);
+		break;
+	case VDP_TRACE_REGISTERS:
+		vdp_set_registers(context, args[0], args[1], data);
+		break;
+	default:
+		break;
+	}
+}
+
+// Blits are skipped and renders to a target only render, replays are meant to run without a window.
+bool vdp_replay_frame(vdp_replay_t *replay, vdp_context_t *context, uint64_t *time) {
+	while (replay->offset + sizeof (trace_record_t) <= replay->size) {
+		trace_record_t record;
+		memcpy(&record, &replay->data[replay->offset], sizeof (record));
+		const size_t args_size = record.arg_count * sizeof (uint32_t);
+		const size_t size = sizeof (record) + args_size + ((record.size + 3) & ~(size_t)3);
+		if (record.arg_count > TRACE_MAX_ARGS || replay->offset + size > replay->size) {
+			break;
+		}
+		uint32_t args[TRACE_MAX_ARGS];
+		memcpy(args, &replay->data[replay->offset + sizeof (record)], args_size);
+		const uint8_t *payload = &replay->data[replay->offset + sizeof (record) + args_size];
+		replay->offset += size;
+
+		const vdp_trace_op_t op = (vdp_trace_op_t)record.op;
+		if ((op == VDP_TRACE_RENDER || op == VDP_TRACE_RENDER_TO) && record.arg_count >= 2) {
+			vdp_render(context);
+			if (time) {
+				*time = (uint64_t)args[record.arg_count - 1] << 32 | args[record.arg_count - 2];
+			}
+			return true;
+		}
+		trace_target_t target;
+		if (!trace_target(&replay->mirror, op, args, &target)) {
+			vdp_trace_apply(context, op, args, NULL);
+			continue;
+		}
+		const size_t data_size = target.row_size * target.rows;
+		uint8_t *data = reserve(&replay->buffer, &replay->capacity, data_size);
+		gather(&target, data);
+		if (!decode(payload, record.size, data, data_size)) {
+			fprintf(stderr, "Corrupt trace record at offset %zu.\n", replay->offset - size);
+			break;
+		}
+		scatter(&target, data);
+		vdp_trace_apply(context, op, args, data);
+	}
+	replay->offset = replay->size;
+	return false;
+}
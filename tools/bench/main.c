@@ -0,0 +1,338 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <GL/gl3w.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <vdp.h>
+
+#define countof(a) (sizeof (a) / sizeof (a[0]))
+
+enum {
+	WARMUP_FRAMES = 8
+};
+
+// Synthetic worst case scenes, rendered headless for a fixed number of frames. Every scene is built
+// from a fixed seed and animated from the frame number alone so that runs compare across commits and drivers.
+
+typedef struct scene {
+	const char *name;
+	void (*setup)(vdp_context_t *vdp);
+	void (*update)(vdp_context_t *vdp, unsigned int frame);
+} scene_t;
+
+static const struct {
+	const char *name;
+	vdp_backend_t backend;
+} backends[] = {
+	{ "opengl", VDP_BACKEND_OPENGL },
+	{ "compute", VDP_BACKEND_COMPUTE },
+	{ "software", VDP_BACKEND_SOFTWARE },
+	{ "reference", VDP_BACKEND_REFERENCE },
+};
+
+static const char *table_names[VDP_TABLE_COUNT] = {
+	"colors", "patterns", "sprites", "cells", "hscroll", "vscroll", "vram", "cram", "vsram", "registers"
+};
+
+static uint32_t seed;
+static vdp_color_t color_table[VDP_COLOR_COUNT];
+static uint32_t pattern_table[VDP_PATTERN_COUNT * VDP_PATTERN_WIDTH * VDP_PATTERN_HEIGHT * VDP_PATTERN_BPP / 32];
+static vdp_sprite_t sprite_table[VDP_SPRITE_COUNT];
+static vdp_cell_t plane_table[VDP_PLANE_MAX_HEIGHT][VDP_PLANE_MAX_WIDTH];
+static uint16_t hscroll_table[VDP_HSCROLL_COUNT];
+static uint16_t vscroll_table[VDP_VSCROLL_COUNT];
+
+static double get_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t next_random() {
+	seed = seed * 1664525u + 1013904223u;
+	return seed >> 8;
+}
+
+// Random colors and patterns, every fourth pixel transparent.
+static void set_tiles(vdp_context_t *vdp) {
+	for (unsigned int i = 0; i < countof (color_table); ++i) {
+		color_table[i].rgb = next_random() & 0xFFFFFF;
+	}
+	for (unsigned int i = 0; i < countof (pattern_table); ++i) {
+		pattern_table[i] = next_random() << 8 | (next_random() & 0xFF);
+		pattern_table[i] &= 0xFFF0FFF0u | (i & 1 ? 0 : 0x000F000Fu);
+	}
+	vdp_set_colors_sh(vdp, 0, countof (color_table), color_table);
+	vdp_set_patterns(vdp, 0, VDP_PATTERN_COUNT, pattern_table);
+}
+
+static void set_plane(vdp_context_t *vdp, vdp_plane_t plane, unsigned int width, unsigned int height) {
+	for (unsigned int j = 0; j < height; ++j) {
+		for (unsigned int i = 0; i < width; ++i) {
+			uint32_t r = next_random();
+			plane_table[j][i].pattern = r & 0x7FF;
+			plane_table[j][i].hflip = (r >> 11) & 1;
+			plane_table[j][i].vflip = (r >> 12) & 1;
+			plane_table[j][i].palette = (r >> 13) & 3;
+			plane_table[j][i].priority = (r >> 15) & 1;
+		}
+	}
+	vdp_set_cells(vdp, plane, 0, 0, width, height, &plane_table[0][0]);
+}
+
+static void set_scroll(vdp_context_t *vdp, vdp_plane_t plane, int x, int y) {
+	for (unsigned int i = 0; i < VDP_HSCROLL_COUNT; ++i) {
+		hscroll_table[i] = (uint16_t)x;
+	}
+	for (unsigned int i = 0; i < VDP_VSCROLL_COUNT; ++i) {
+		vscroll_table[i] = (uint16_t)y;
+	}
+	vdp_set_hscroll(vdp, plane, 0, VDP_HSCROLL_COUNT, hscroll_table);
+	vdp_set_vscroll(vdp, plane, 0, VDP_VSCROLL_COUNT, vscroll_table);
+}
+
+// 80 linked 4x4 sprites spread over the screen.
+static void set_sprites(vdp_context_t *vdp, unsigned int frame, unsigned int palette_mask) {
+	memset(sprite_table, 0, sizeof (sprite_table));
+	for (unsigned int i = 0; i < 80; ++i) {
+		sprite_table[i].x = 128 - 16 + (i * 53 + frame) % (VDP_FRAMEBUFFER_WIDTH + 32);
+		sprite_table[i].y = 128 - 16 + (i * 37 + frame / 2) % (VDP_FRAMEBUFFER_HEIGHT + 32);
+		sprite_table[i].hsize = 3;
+		sprite_table[i].vsize = 3;
+		sprite_table[i].pattern = i * 16;
+		sprite_table[i].hflip = i & 1;
+		sprite_table[i].vflip = (i >> 1) & 1;
+		sprite_table[i].palette = i & palette_mask;
+		sprite_table[i].priority = (i >> 2) & 1;
+		sprite_table[i].link = i + 1 < 80 ? i + 1 : 0;
+	}
+	vdp_set_sprites(vdp, 0, VDP_SPRITE_COUNT, sprite_table);
+}
+
+static void plane_setup(vdp_context_t *vdp) {
+	set_tiles(vdp);
+	vdp_set_plane_size(vdp, VDP_PLANE_MAX_WIDTH, VDP_PLANE_MAX_HEIGHT);
+	set_plane(vdp, VDP_PLANE_A, VDP_PLANE_MAX_WIDTH, VDP_PLANE_MAX_HEIGHT);
+	set_plane(vdp, VDP_PLANE_B, VDP_PLANE_MAX_WIDTH, VDP_PLANE_MAX_HEIGHT);
+}
+
+static void plane_update(vdp_context_t *vdp, unsigned int frame) {
+	set_scroll(vdp, VDP_PLANE_A, -(int)frame * 3, (int)frame * 2);
+	set_scroll(vdp, VDP_PLANE_B, (int)frame, -(int)frame);
+}
+
+static void hscroll_setup(vdp_context_t *vdp) {
+	set_tiles(vdp);
+	vdp_set_plane_size(vdp, 64, 32);
+	set_plane(vdp, VDP_PLANE_A, 64, 32);
+	set_plane(vdp, VDP_PLANE_B, 64, 32);
+}
+
+static void hscroll_update(vdp_context_t *vdp, unsigned int frame) {
+	for (unsigned int i = 0; i < VDP_HSCROLL_COUNT; ++i) {
+		hscroll_table[i] = (uint16_t)(int)(32.0 * sin((i + frame) * 0.1));
+	}
+	vdp_set_hscroll(vdp, VDP_PLANE_A, 0, VDP_HSCROLL_COUNT, hscroll_table);
+	for (unsigned int i = 0; i < VDP_HSCROLL_COUNT; ++i) {
+		hscroll_table[i] = (uint16_t)(frame * (i + 1) / 64);
+	}
+	vdp_set_hscroll(vdp, VDP_PLANE_B, 0, VDP_HSCROLL_COUNT, hscroll_table);
+}
+
+static void sprites_setup(vdp_context_t *vdp) {
+	set_tiles(vdp);
+	set_plane(vdp, VDP_PLANE_A, 32, 32);
+	set_plane(vdp, VDP_PLANE_B, 32, 32);
+}
+
+static void sprites_update(vdp_context_t *vdp, unsigned int frame) {
+	set_sprites(vdp, frame, 3);
+}
+
+// Sprites with palette 3 colors 14 and 15 act as highlight and shadow operators.
+static void shadow_setup(vdp_context_t *vdp) {
+	set_tiles(vdp);
+	vdp_set_mode(vdp, VDP_MODE_INTENSITY);
+	set_plane(vdp, VDP_PLANE_A, 32, 32);
+	set_plane(vdp, VDP_PLANE_B, 32, 32);
+	for (unsigned int i = 0; i < 80 * 16 * 8; ++i) {
+		pattern_table[i] |= 0xEEEEEEEEu & (i & 2 ? 0xF0F0F0F0u : 0x0F0F0F0Fu);
+	}
+	vdp_set_patterns(vdp, 0, 80 * 16, pattern_table);
+}
+
+static void shadow_update(vdp_context_t *vdp, unsigned int frame) {
+	set_sprites(vdp, frame, 3);
+	set_scroll(vdp, VDP_PLANE_B, (int)frame, 0);
+}
+
+static void window_setup(vdp_context_t *vdp) {
+	set_tiles(vdp);
+	vdp_set_plane_size(vdp, 64, 64);
+	set_plane(vdp, VDP_PLANE_A, 64, 64);
+	set_plane(vdp, VDP_PLANE_B, 64, 64);
+	set_plane(vdp, VDP_PLANE_W, 64, 64);
+}
+
+static void window_update(vdp_context_t *vdp, unsigned int frame) {
+	int x = (int)(frame / 4 % 20) * 16;
+	int y = (int)(frame / 4 % 28) * 8;
+	vdp_set_window_coord(vdp, frame & 1 ? x : -x, frame & 2 ? y : -y);
+	set_scroll(vdp, VDP_PLANE_A, -(int)frame, (int)frame);
+}
+
+static const scene_t scenes[] = {
+	{ "plane_128x128", plane_setup, plane_update },
+	{ "line_hscroll", hscroll_setup, hscroll_update },
+	{ "sprites_80", sprites_setup, sprites_update },
+	{ "shadow_highlight", shadow_setup, shadow_update },
+	{ "window_split", window_setup, window_update },
+};
+
+static bool run_scene(const scene_t *scene, vdp_backend_t backend, unsigned int frames, bool first) {
+	const double create_start = get_time();
+	vdp_context_t *vdp = vdp_create_backend_context(backend);
+	if (!vdp) {
+		return false;
+	}
+	const double create_time = get_time() - create_start;
+	seed = 1;
+	scene->setup(vdp);
+
+	// warm up caches and drain the timer queries before measuring anything
+	vdp_stats_t stats;
+	for (unsigned int frame = 0; frame < WARMUP_FRAMES; ++frame) {
+		scene->update(vdp, frame);
+		vdp_render(vdp);
+	}
+	glFinish();
+	vdp_get_stats(vdp, &stats);
+	vdp_reset_upload_stats(vdp);
+
+	// update is the CPU time spent in vdp_set_*, submit the CPU time spent in vdp_render
+	double update_time = 0.0;
+	double submit_time = 0.0;
+	double render_ms = 0.0;
+	double uploaded_bytes[VDP_TABLE_COUNT] = { 0.0 };
+	const double start = get_time();
+	for (unsigned int frame = 0; frame < frames; ++frame) {
+		const double t0 = get_time();
+		scene->update(vdp, frame);
+		const double t1 = get_time();
+		vdp_render(vdp);
+		update_time += t1 - t0;
+		submit_time += get_time() - t1;
+		vdp_get_stats(vdp, &stats);
+		render_ms += stats.render_ms;
+		for (unsigned int i = 0; i < VDP_TABLE_COUNT; ++i) {
+			uploaded_bytes[i] += (double)stats.uploaded_bytes[i];
+		}
+	}
+	glFinish();
+	const double elapsed = get_time() - start;
+	vdp_get_stats(vdp, &stats);
+
+	double total_bytes = 0.0;
+	for (unsigned int i = 0; i < VDP_TABLE_COUNT; ++i) {
+		total_bytes += uploaded_bytes[i];
+	}
+	printf("%s\t\t{\n", first ? "" : ",\n");
+	printf("\t\t\t\"name\": \"%s\",\n", scene->name);
+	printf("\t\t\t\"frames\": %u,\n", frames);
+	printf("\t\t\t\"create_ms\": %.3f,\n", create_time * 1e3);
+	printf("\t\t\t\"fps\": %.2f,\n", frames / elapsed);
+	printf("\t\t\t\"frame_ms\": { \"min\": %.3f, \"avg\": %.3f, \"p99\": %.3f },\n", stats.frame_ms_min, stats.frame_ms_avg, stats.frame_ms_p99);
+	printf("\t\t\t\"stage_ms\": { \"update\": %.3f, \"submit\": %.3f, \"render\": %.3f },\n", update_time * 1e3 / frames, submit_time * 1e3 / frames, render_ms / frames);
+	printf("\t\t\t\"upload_mb_per_s\": %.3f,\n", total_bytes / elapsed / (1024.0 * 1024.0));
+	printf("\t\t\t\"uploaded_bytes_per_frame\": {");
+	for (unsigned int i = 0; i < VDP_TABLE_COUNT; ++i) {
+		printf("%s \"%s\": %.0f", i ? "," : "", table_names[i], uploaded_bytes[i] / frames);
+	}
+	printf(" }\n\t\t}");
+	vdp_destroy_context(vdp);
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned int frames = 600;
+	const char *backend_name = "opengl";
+	const char *scene_name = NULL;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+			frames = (unsigned int)strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "--backend") && i + 1 < argc) {
+			backend_name = argv[++i];
+		} else if (!strcmp(argv[i], "--scene") && i + 1 < argc) {
+			scene_name = argv[++i];
+		} else if (!strcmp(argv[i], "--program-cache") && i + 1 < argc) {
+			vdp_set_program_cache(argv[++i]);
+		} else {
+			fprintf(stderr, "usage: %s [--frames n] [--backend opengl|compute|software|reference] [--scene name] [--program-cache dir]\n", argv[0]);
+			return -1;
+		}
+	}
+	unsigned int backend = 0;
+	while (backend < countof (backends) && strcmp(backends[backend].name, backend_name)) {
+		++backend;
+	}
+	if (backend == countof (backends) || !frames) {
+		fprintf(stderr, "Unknown backend '%s', exiting.\n", backend_name);
+		return -1;
+	}
+
+	vdp_headless_t *headless = vdp_create_headless();
+	if (!headless) {
+		fprintf(stderr, "Unable to create headless GL context, exiting.\n");
+		return -1;
+	}
+	if (!gl3wIsSupported(4, 5)) {
+		vdp_destroy_headless(headless);
+		fprintf(stderr, "OpenGL 4.5 not supported, exiting.\n");
+		return -1;
+	}
+
+	printf("{\n");
+	printf("\t\"renderer\": \"%s\",\n", (const char *)glGetString(GL_RENDERER));
+	printf("\t\"version\": \"%s\",\n", (const char *)glGetString(GL_VERSION));
+	printf("\t\"backend\": \"%s\",\n", backends[backend].name);
+	printf("\t\"scenes\": [\n");
+	bool first = true;
+	int result = 0;
+	for (unsigned int i = 0; i < countof (scenes); ++i) {
+		if (scene_name && strcmp(scenes[i].name, scene_name)) {
+			continue;
+		}
+		if (!run_scene(&scenes[i], backends[backend].backend, frames, first)) {
+			fprintf(stderr, "Unable to create VDP emulator for scene '%s'.\n", scenes[i].name);
+			result = -1;
+			break;
+		}
+		first = false;
+	}
+	printf("\n\t]\n}\n");
+
+	vdp_destroy_headless(headless);
+	return result;
+}
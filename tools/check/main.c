@@ -0,0 +1,346 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+#include <GL/gl3w.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vdp.h>
+
+#define countof(a) (sizeof (a) / sizeof (a[0]))
+
+enum {
+	BATCH_SIZE = 3,
+	LINE_CHANGE_COUNT = 4,
+};
+
+// Renders random scenes headless on every GPU and CPU backend and compares them byte for byte against the
+// reference renderer, in every output format, alone, in a batch, replayed from a trace and through a queue.
+// Exits non-zero on the first scene that differs anywhere so that it can gate changes to any render path.
+
+typedef void (*scene_apply_t)(vdp_context_t *vdp, unsigned int index);
+
+static const struct {
+	const char *name;
+	vdp_backend_t backend;
+} backends[] = {
+	{ "opengl", VDP_BACKEND_OPENGL },
+	{ "compute", VDP_BACKEND_COMPUTE },
+	{ "software", VDP_BACKEND_SOFTWARE },
+};
+
+static const struct {
+	const char *name;
+	vdp_format_t format;
+	unsigned int pixel_size;
+} formats[] = {
+	{ "rgba8", VDP_FORMAT_RGBA8, 4 },
+	{ "rgb565", VDP_FORMAT_RGB565, 2 },
+	{ "index8", VDP_FORMAT_INDEX8, 1 },
+};
+
+// Plane sizes include widths that do not divide 2^32 to exercise the scroll wrap around.
+static const unsigned int plane_widths[] = { 32, 40, 48, 64, 96, 128 };
+static const unsigned int plane_heights[] = { 32, 40, 64, 128 };
+
+static uint32_t seed;
+static vdp_color_t color_table[VDP_COLOR_COUNT];
+static uint32_t pattern_table[VDP_PATTERN_COUNT * VDP_PATTERN_HEIGHT];
+static vdp_sprite_t sprite_table[VDP_SPRITE_COUNT];
+static vdp_cell_t plane_table[VDP_PLANE_MAX_HEIGHT][VDP_PLANE_MAX_WIDTH];
+static uint16_t hscroll_table[VDP_HSCROLL_COUNT];
+static uint16_t vscroll_table[VDP_VSCROLL_COUNT];
+static uint8_t vram[VDP_VRAM_SIZE];
+static uint16_t cram[VDP_CRAM_COUNT];
+static uint16_t vsram[VDP_VSRAM_COUNT];
+static uint8_t registers[VDP_REGISTER_COUNT];
+static uint8_t expected[VDP_FRAMEBUFFER_WIDTH * VDP_FRAMEBUFFER_HEIGHT * 4];
+static uint8_t actual[VDP_FRAMEBUFFER_WIDTH * VDP_FRAMEBUFFER_HEIGHT * 4];
+static unsigned int check_count = 0;
+static unsigned int failure_count = 0;
+
+static uint32_t next_random() {
+	seed = seed * 1664525u + 1013904223u;
+	return seed >> 8;
+}
+
+// Lines where the scanline changes of a scene happen, in increasing order.
+static void pick_lines(unsigned int *lines) {
+	for (unsigned int i = 0; i < LINE_CHANGE_COUNT; ++i) {
+		lines[i] = (i * VDP_FRAMEBUFFER_HEIGHT + next_random() % VDP_FRAMEBUFFER_HEIGHT) / LINE_CHANGE_COUNT;
+	}
+}
+
+static int random_window() {
+	const int coord = (int)(next_random() % 4);
+	return coord == 0 ? 0 : coord == 1 ? (int)(next_random() % 20) * 16 : -(int)(next_random() % 20) * 16;
+}
+
+// Everything set through the table setters, with the mode, plane size, background and window changing
+// a few times down the frame.
+static void legacy_scene(vdp_context_t *vdp, unsigned int index) {
+	seed = index * 7919u + 1;
+	for (unsigned int i = 0; i < countof (color_table); ++i) {
+		color_table[i].rgb = next_random() & 0xFFFFFF;
+	}
+	for (unsigned int i = 0; i < countof (pattern_table); ++i) {
+		pattern_table[i] = next_random() << 8 | (next_random() & 0xFF);
+		pattern_table[i] &= 0xFFF0FFF0u | (i & 1 ? 0 : 0x000F000Fu);
+	}
+	vdp_set_colors_sh(vdp, 0, countof (color_table), color_table);
+	vdp_set_patterns(vdp, 0, VDP_PATTERN_COUNT, pattern_table);
+	for (unsigned int plane = 0; plane < VDP_PLANE_COUNT; ++plane) {
+		for (unsigned int j = 0; j < VDP_PLANE_MAX_HEIGHT; ++j) {
+			for (unsigned int i = 0; i < VDP_PLANE_MAX_WIDTH; ++i) {
+				const uint32_t r = next_random();
+				plane_table[j][i].pattern = r & 0x7FF;
+				plane_table[j][i].hflip = (r >> 11) & 1;
+				plane_table[j][i].vflip = (r >> 12) & 1;
+				plane_table[j][i].palette = (r >> 13) & 3;
+				plane_table[j][i].priority = (r >> 15) & 1;
+			}
+		}
+		vdp_set_cells(vdp, (vdp_plane_t)plane, 0, 0, VDP_PLANE_MAX_WIDTH, VDP_PLANE_MAX_HEIGHT, &plane_table[0][0]);
+	}
+	for (unsigned int plane = 0; plane < 2; ++plane) {
+		const uint32_t hscroll = next_random();
+		const uint32_t vscroll = next_random();
+		const bool per_line = next_random() & 1;
+		for (unsigned int i = 0; i < VDP_HSCROLL_COUNT; ++i) {
+			hscroll_table[i] = (uint16_t)(per_line ? next_random() : hscroll);
+		}
+		for (unsigned int i = 0; i < VDP_VSCROLL_COUNT; ++i) {
+			vscroll_table[i] = (uint16_t)(per_line ? next_random() : vscroll);
+		}
+		vdp_set_hscroll(vdp, (vdp_plane_t)plane, 0, VDP_HSCROLL_COUNT, hscroll_table);
+		vdp_set_vscroll(vdp, (vdp_plane_t)plane, 0, VDP_VSCROLL_COUNT, vscroll_table);
+	}
+	memset(sprite_table, 0, sizeof (sprite_table));
+	for (unsigned int i = 0; i < 80; ++i) {
+		const uint32_t r = next_random();
+		sprite_table[i].x = (uint16_t)(128 - 32 + next_random() % (VDP_FRAMEBUFFER_WIDTH + 32));
+		sprite_table[i].y = (uint16_t)(128 - 32 + next_random() % (VDP_FRAMEBUFFER_HEIGHT + 32));
+		sprite_table[i].hsize = r & 3;
+		sprite_table[i].vsize = (r >> 2) & 3;
+		sprite_table[i].pattern = (r >> 4) & 0x7FF;
+		sprite_table[i].hflip = (r >> 15) & 1;
+		sprite_table[i].vflip = (r >> 16) & 1;
+		sprite_table[i].palette = (r >> 17) & 3;
+		sprite_table[i].priority = (r >> 19) & 1;
+		sprite_table[i].link = i + 1 < 80 ? i + 1 : 0;
+	}
+	vdp_set_sprites(vdp, 0, VDP_SPRITE_COUNT, sprite_table);
+
+	unsigned int lines[LINE_CHANGE_COUNT];
+	pick_lines(lines);
+	for (unsigned int i = 0; i < LINE_CHANGE_COUNT; ++i) {
+		vdp_set_line(vdp, i ? lines[i] : 0);
+		vdp_set_mode(vdp, next_random() & 1 ? VDP_MODE_INTENSITY : VDP_MODE_NORMAL);
+		vdp_set_background_color(vdp, next_random() % VDP_COLOR_COUNT);
+		vdp_set_plane_size(vdp, plane_widths[next_random() % countof (plane_widths)], plane_heights[next_random() % countof (plane_heights)]);
+		vdp_set_window_coord(vdp, random_window(), random_window() / 2);
+	}
+}
+
+// Raw memories as an emulator hands them over, with registers and CRAM rewritten down the frame.
+static void native_scene(vdp_context_t *vdp, unsigned int index) {
+	seed = index * 7919u + 2;
+	for (unsigned int i = 0; i < countof (vram); ++i) {
+		vram[i] = (uint8_t)next_random();
+	}
+	for (unsigned int i = 0; i < countof (cram); ++i) {
+		cram[i] = (uint16_t)(next_random() & 0xEEE);
+	}
+	for (unsigned int i = 0; i < countof (vsram); ++i) {
+		vsram[i] = (uint16_t)(next_random() & 0x7FF);
+	}
+	for (unsigned int i = 0; i < countof (registers); ++i) {
+		registers[i] = (uint8_t)next_random();
+	}
+	vdp_begin_update(vdp);
+	vdp_set_vram(vdp, 0, VDP_VRAM_SIZE, vram);
+	vdp_set_cram(vdp, 0, VDP_CRAM_COUNT, cram);
+	vdp_set_vsram(vdp, 0, VDP_VSRAM_COUNT, vsram);
+	vdp_set_registers(vdp, 0, VDP_REGISTER_COUNT, registers);
+
+	unsigned int lines[LINE_CHANGE_COUNT];
+	pick_lines(lines);
+	for (unsigned int i = 0; i < LINE_CHANGE_COUNT; ++i) {
+		vdp_set_line(vdp, lines[i]);
+		registers[7] = (uint8_t)next_random();
+		registers[12] ^= (uint8_t)(next_random() & 0x08);
+		registers[16] = (uint8_t)(next_random() & 0x33);
+		registers[17] = (uint8_t)next_random();
+		registers[18] = (uint8_t)next_random();
+		vdp_set_registers(vdp, 0, VDP_REGISTER_COUNT, registers);
+		const unsigned int start = next_random() % (VDP_CRAM_COUNT - 4);
+		for (unsigned int j = 0; j < 4; ++j) {
+			cram[start + j] = (uint16_t)(next_random() & 0xEEE);
+		}
+		vdp_set_cram(vdp, start, 4, &cram[start]);
+	}
+	vdp_commit_update(vdp);
+}
+
+static const struct {
+	const char *name;
+	scene_apply_t apply;
+} scenes[] = {
+	{ "legacy", legacy_scene },
+	{ "native", native_scene },
+};
+
+static void render_reference(scene_apply_t apply, unsigned int index, vdp_format_t format) {
+	vdp_context_t *vdp = vdp_create_backend_context(VDP_BACKEND_REFERENCE);
+	vdp_set_output_format(vdp, format);
+	apply(vdp, index);
+	vdp_render(vdp);
+	vdp_read_pixels(vdp, expected);
+	vdp_destroy_context(vdp);
+}
+
+static void compare(vdp_context_t *vdp, const char *path, const char *backend, const char *format, unsigned int pixel_size, const char *scene, unsigned int index) {
+	vdp_read_pixels(vdp, actual);
+	unsigned int differences = 0;
+	for (unsigned int i = 0; i < VDP_FRAMEBUFFER_WIDTH * VDP_FRAMEBUFFER_HEIGHT; ++i) {
+		differences += memcmp(&expected[i * pixel_size], &actual[i * pixel_size], pixel_size) != 0;
+	}
+	++check_count;
+	if (differences) {
+		printf("%s %s %s %s scene %u: %u pixels differ\n", path, backend, format, scene, index, differences);
+		++failure_count;
+	}
+}
+
+static void check_single(scene_apply_t apply, const char *scene, unsigned int index) {
+	for (unsigned int i = 0; i < countof (formats); ++i) {
+		render_reference(apply, index, formats[i].format);
+		for (unsigned int j = 0; j < countof (backends); ++j) {
+			vdp_context_t *vdp = vdp_create_backend_context(backends[j].backend);
+			vdp_set_output_format(vdp, formats[i].format);
+			apply(vdp, index);
+			vdp_render(vdp);
+			compare(vdp, "single", backends[j].name, formats[i].name, formats[i].pixel_size, scene, index);
+			vdp_destroy_context(vdp);
+		}
+	}
+}
+
+// Instances of a batch render different scenes in one pass.
+static void check_batch(scene_apply_t apply, const char *scene, unsigned int index) {
+	vdp_batch_t *batch = vdp_create_batch(BATCH_SIZE);
+	for (unsigned int i = 0; i < BATCH_SIZE; ++i) {
+		apply(vdp_get_batch_context(batch, i), index + i);
+	}
+	vdp_render_batch(batch);
+	for (unsigned int i = 0; i < BATCH_SIZE; ++i) {
+		render_reference(apply, index + i, VDP_FORMAT_RGBA8);
+		compare(vdp_get_batch_context(batch, i), "batch", "opengl", "rgba8", 4, scene, index + i);
+	}
+	vdp_destroy_batch(batch);
+}
+
+// The scene is recorded once off the reference renderer, then replayed on every backend.
+static void check_replay(scene_apply_t apply, const char *scene, unsigned int index, const char *trace_path) {
+	render_reference(apply, index, VDP_FORMAT_RGBA8);
+	vdp_context_t *recorder = vdp_create_backend_context(VDP_BACKEND_REFERENCE);
+	vdp_start_trace(recorder, trace_path);
+	apply(recorder, index);
+	vdp_render(recorder);
+	vdp_stop_trace(recorder);
+	vdp_destroy_context(recorder);
+	for (unsigned int i = 0; i < countof (backends); ++i) {
+		vdp_replay_t *replay = vdp_open_replay(trace_path);
+		vdp_context_t *vdp = vdp_create_backend_context(backends[i].backend);
+		uint64_t time;
+		while (replay && vdp_replay_frame(replay, vdp, &time)) {
+		}
+		compare(vdp, "replay", backends[i].name, "rgba8", 4, scene, index);
+		vdp_destroy_context(vdp);
+		vdp_close_replay(replay);
+	}
+}
+
+static void check_queue(scene_apply_t apply, const char *scene, unsigned int index) {
+	render_reference(apply, index, VDP_FORMAT_RGBA8);
+	for (unsigned int i = 0; i < countof (backends); ++i) {
+		vdp_queue_t *queue = vdp_create_queue(0);
+		vdp_context_t *producer = vdp_create_queue_context(queue);
+		apply(producer, index);
+		vdp_render(producer);
+		vdp_context_t *vdp = vdp_create_backend_context(backends[i].backend);
+		if (!vdp_run_queue(queue, vdp)) {
+			printf("queue %s rgba8 %s scene %u: no frame rendered\n", backends[i].name, scene, index);
+			++failure_count;
+		}
+		compare(vdp, "queue", backends[i].name, "rgba8", 4, scene, index);
+		vdp_destroy_context(vdp);
+		vdp_destroy_context(producer);
+		vdp_destroy_queue(queue);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	unsigned int scene_count = 16;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--scenes") && i + 1 < argc) {
+			scene_count = (unsigned int)strtoul(argv[++i], NULL, 10);
+		} else {
+			fprintf(stderr, "usage: %s [--scenes n]\n", argv[0]);
+			return -1;
+		}
+	}
+
+	vdp_headless_t *headless = vdp_create_headless();
+	if (!headless) {
+		fprintf(stderr, "Unable to create headless GL context, exiting.\n");
+		return -1;
+	}
+	if (!gl3wIsSupported(4, 5)) {
+		vdp_destroy_headless(headless);
+		fprintf(stderr, "OpenGL 4.5 not supported, exiting.\n");
+		return -1;
+	}
+	char trace_path[] = "/tmp/glvdp_check_XXXXXX";
+	const int fd = mkstemp(trace_path);
+	if (fd < 0) {
+		vdp_destroy_headless(headless);
+		fprintf(stderr, "Unable to create a temporary trace, exiting.\n");
+		return -1;
+	}
+	close(fd);
+
+	for (unsigned int i = 0; i < scene_count; ++i) {
+		for (unsigned int j = 0; j < countof (scenes); ++j) {
+			check_single(scenes[j].apply, scenes[j].name, i);
+			check_batch(scenes[j].apply, scenes[j].name, i);
+			check_replay(scenes[j].apply, scenes[j].name, i, trace_path);
+			check_queue(scenes[j].apply, scenes[j].name, i);
+		}
+	}
+	printf("%u checks against the reference renderer on %s, %u failed\n", check_count, (const char *)glGetString(GL_RENDERER), failure_count);
+
+	unlink(trace_path);
+	vdp_destroy_headless(headless);
+	return failure_count ? -1 : 0;
+}
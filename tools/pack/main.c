@@ -0,0 +1,305 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <lodepng.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vdp.h>
+#include <vdp_pack.h>
+
+#define countof(a) (sizeof (a) / sizeof (a[0]))
+
+enum {
+	PALETTE_SIZE = 16,
+	MAX_PALETTES = VDP_COLOR_COUNT / PALETTE_SIZE,
+	SLOT_COUNT = VDP_PATTERN_COUNT * 2,
+};
+
+// Converts indexed PNGs into a pack that vdp_open_pack maps as is: one 16 color palette line per
+// distinct palette, the patterns, and one name table per image. Tiles that repeat, as they are or
+// flipped horizontally and/or vertically, share a single pattern and only differ by their cell flip
+// bits. Sprite images are laid out column by column without sharing since sprites need their patterns
+// to be consecutive.
+
+typedef struct map {
+	uint32_t width;
+	uint32_t height;
+	vdp_cell_t *cells;
+} map_t;
+
+static vdp_color_t palettes[MAX_PALETTES][PALETTE_SIZE];
+static unsigned int palette_count = 0;
+static uint32_t patterns[VDP_PATTERN_COUNT][VDP_PATTERN_HEIGHT];
+static unsigned int pattern_count = 0;
+static uint16_t slots[SLOT_COUNT]; // pattern index + 1, 0 when empty
+static map_t *maps = NULL;
+static unsigned int map_count = 0;
+static unsigned int first_pattern = 0;
+static unsigned int first_palette = 0;
+static unsigned int tile_count = 0;
+static unsigned int flipped_count = 0;
+
+// Pixel 2k is the high nibble of byte k of a pattern row, same as a 4 bit PNG row.
+static inline unsigned int pixel_shift(unsigned int x) {
+	return x / 2 * 8 + (x % 2 ? 0 : 4);
+}
+
+static uint32_t flip_row(uint32_t row) {
+	uint32_t flipped = 0;
+	for (unsigned int x = 0; x < VDP_PATTERN_WIDTH; ++x) {
+		flipped |= (row >> pixel_shift(x) & 0xF) << pixel_shift(VDP_PATTERN_WIDTH - 1 - x);
+	}
+	return flipped;
+}
+
+// FNV-1a over the rows.
+static unsigned int hash_pattern(const uint32_t *pattern) {
+	uint32_t hash = 0x811C9DC5u;
+	for (unsigned int i = 0; i < VDP_PATTERN_HEIGHT; ++i) {
+		for (unsigned int j = 0; j < 4; ++j) {
+			hash = (hash ^ (pattern[i] >> j * 8 & 0xFF)) * 0x01000193u;
+		}
+	}
+	return hash % SLOT_COUNT;
+}
+
+static unsigned int find_slot(const uint32_t *pattern) {
+	unsigned int slot = hash_pattern(pattern);
+	while (slots[slot] && memcmp(patterns[slots[slot] - 1], pattern, sizeof (patterns[0]))) {
+		slot = (slot + 1) % SLOT_COUNT;
+	}
+	return slot;
+}
+
+static bool add_pattern(const uint32_t *pattern) {
+	if (first_pattern + pattern_count >= VDP_PATTERN_COUNT) {
+		fprintf(stderr, "More than %d patterns, exiting.\n", VDP_PATTERN_COUNT);
+		return false;
+	}
+	memcpy(patterns[pattern_count++], pattern, sizeof (patterns[0]));
+	return true;
+}
+
+// Looks the tile up as it is, then flipped, and only adds a pattern when none of the four match.
+static bool add_tile(const uint32_t *tile, vdp_cell_t *cell) {
+	for (unsigned int flip = 0; flip < 4; ++flip) {
+		const bool hflip = flip & 1;
+		const bool vflip = flip & 2;
+		uint32_t pattern[VDP_PATTERN_HEIGHT];
+		for (unsigned int i = 0; i < VDP_PATTERN_HEIGHT; ++i) {
+			const uint32_t row = tile[vflip ? VDP_PATTERN_HEIGHT - 1 - i : i];
+			pattern[i] = hflip ? flip_row(row) : row;
+		}
+		const unsigned int slot = find_slot(pattern);
+		if (slots[slot]) {
+			cell->pattern = first_pattern + slots[slot] - 1;
+			cell->hflip = hflip;
+			cell->vflip = vflip;
+			flipped_count += flip != 0;
+			return true;
+		}
+	}
+	cell->pattern = first_pattern + pattern_count;
+	if (!add_pattern(tile)) {
+		return false;
+	}
+	slots[find_slot(tile)] = (uint16_t)pattern_count;
+	return true;
+}
+
+static int add_palette(const LodePNGColorMode *color) {
+	vdp_color_t palette[PALETTE_SIZE];
+	memset(palette, 0, sizeof (palette));
+	for (unsigned int i = 0; i < PALETTE_SIZE && i < color->palettesize; ++i) {
+		palette[i].r = color->palette[i * 4 + 0];
+		palette[i].g = color->palette[i * 4 + 1];
+		palette[i].b = color->palette[i * 4 + 2];
+	}
+	for (unsigned int i = 0; i < palette_count; ++i) {
+		if (!memcmp(palettes[i], palette, sizeof (palette))) {
+			return (int)i;
+		}
+	}
+	if (first_palette + palette_count >= MAX_PALETTES) {
+		fprintf(stderr, "More than %d palettes, exiting.\n", MAX_PALETTES);
+		return -1;
+	}
+	memcpy(palettes[palette_count], palette, sizeof (palette));
+	return (int)palette_count++;
+}
+
+// Gathers the tile at cell (x, y) as pattern rows, false when it uses a color past the first 16.
+static bool read_tile(const unsigned char *pixels, unsigned int width, unsigned int bitdepth, unsigned int x, unsigned int y, uint32_t *tile) {
+	for (unsigned int i = 0; i < VDP_PATTERN_HEIGHT; ++i) {
+		tile[i] = 0;
+		for (unsigned int j = 0; j < VDP_PATTERN_WIDTH; ++j) {
+			const size_t offset = (size_t)(y * VDP_PATTERN_HEIGHT + i) * width + x * VDP_PATTERN_WIDTH + j;
+			const unsigned int index = bitdepth == 8 ? pixels[offset] : pixels[offset / 2] >> (offset % 2 ? 0 : 4) & 0xF;
+			if (index >= PALETTE_SIZE) {
+				return false;
+			}
+			tile[i] |= (uint32_t)index << pixel_shift(j);
+		}
+	}
+	return true;
+}
+
+static bool add_image(const char *path, bool is_sprite) {
+	unsigned char *file = NULL;
+	size_t size = 0;
+	unsigned char *pixels = NULL;
+	unsigned int width, height;
+	LodePNGState state;
+	lodepng_state_init(&state);
+	state.decoder.color_convert = 0;
+	if (lodepng_load_file(&file, &size, path) || lodepng_decode(&pixels, &width, &height, &state, file, size)) {
+		fprintf(stderr, "Unable to decode '%s', exiting.\n", path);
+		lodepng_state_cleanup(&state);
+		free(file);
+		return false;
+	}
+	free(file);
+
+	const LodePNGColorMode *color = &state.info_png.color;
+	bool success = false;
+	if (color->colortype != LCT_PALETTE || (color->bitdepth != 4 && color->bitdepth != 8)) {
+		fprintf(stderr, "'%s' is not a 4 or 8 bit indexed PNG, exiting.\n", path);
+	} else if (width % VDP_PATTERN_WIDTH || height % VDP_PATTERN_HEIGHT) {
+		fprintf(stderr, "'%s' is not made of whole %dx%d cells, exiting.\n", path, VDP_PATTERN_WIDTH, VDP_PATTERN_HEIGHT);
+	} else {
+		const int palette = add_palette(color);
+		map_t *map = &maps[map_count++];
+		map->width = width / VDP_PATTERN_WIDTH;
+		map->height = height / VDP_PATTERN_HEIGHT;
+		map->cells = calloc((size_t)map->width * map->height, sizeof (vdp_cell_t));
+		success = palette >= 0;
+		for (unsigned int i = 0; success && i < map->width * map->height; ++i) {
+			// column major for sprites, row major otherwise
+			const unsigned int x = is_sprite ? i / map->height : i % map->width;
+			const unsigned int y = is_sprite ? i % map->height : i / map->width;
+			vdp_cell_t *cell = &map->cells[x + y * map->width];
+			uint32_t tile[VDP_PATTERN_HEIGHT];
+			if (!read_tile(pixels, width, color->bitdepth, x, y, tile)) {
+				fprintf(stderr, "'%s' uses more than %d colors, exiting.\n", path, PALETTE_SIZE);
+				success = false;
+				break;
+			}
+			cell->palette = first_palette + palette;
+			if (is_sprite) {
+				// still there for the tiles of later images to share
+				cell->pattern = first_pattern + pattern_count;
+				const unsigned int slot = find_slot(tile);
+				success = add_pattern(tile);
+				slots[slot] = slots[slot] ? slots[slot] : (uint16_t)pattern_count;
+			} else {
+				success = add_tile(tile, cell);
+			}
+			++tile_count;
+		}
+	}
+	lodepng_state_cleanup(&state);
+	free(pixels);
+	return success;
+}
+
+static uint32_t align(uint32_t offset) {
+	return (offset + 3) & ~3u;
+}
+
+static bool write_pack(const char *path) {
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		fprintf(stderr, "Unable to create '%s', exiting.\n", path);
+		return false;
+	}
+	const uint32_t color_offset = sizeof (vdp_pack_header_t);
+	const uint32_t pattern_offset = color_offset + palette_count * sizeof (palettes[0]);
+	const uint32_t map_offset = pattern_offset + pattern_count * sizeof (patterns[0]);
+	const vdp_pack_header_t header = {
+		{ 'G', 'V', 'P', 'K' }, VDP_PACK_VERSION,
+		palette_count * PALETTE_SIZE, color_offset,
+		pattern_count, pattern_offset,
+		map_count, map_offset
+	};
+	fwrite(&header, sizeof (header), 1, file);
+	fwrite(palettes, sizeof (palettes[0]), palette_count, file);
+	fwrite(patterns, sizeof (patterns[0]), pattern_count, file);
+
+	uint32_t offset = map_offset + map_count * sizeof (vdp_pack_entry_t);
+	for (unsigned int i = 0; i < map_count; ++i) {
+		const vdp_pack_entry_t entry = { maps[i].width, maps[i].height, offset };
+		fwrite(&entry, sizeof (entry), 1, file);
+		offset = align(offset + maps[i].width * maps[i].height * sizeof (vdp_cell_t));
+	}
+	static const uint8_t padding[3] = { 0 };
+	for (unsigned int i = 0; i < map_count; ++i) {
+		const size_t size = maps[i].width * maps[i].height * sizeof (vdp_cell_t);
+		fwrite(maps[i].cells, 1, size, file);
+		fwrite(padding, 1, (4 - size % 4) % 4, file);
+	}
+	const bool success = !ferror(file);
+	if (fclose(file) || !success) {
+		fprintf(stderr, "Unable to write '%s', exiting.\n", path);
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	const char *path = NULL;
+	bool is_sprite = false;
+	bool usage = false;
+	bool success = true;
+	maps = calloc((size_t)argc, sizeof (map_t));
+	for (int i = 1; success && !usage && i < argc; ++i) {
+		if (!strcmp(argv[i], "--pattern") && i + 1 < argc && !path) {
+			first_pattern = (unsigned int)strtoul(argv[++i], NULL, 10);
+			usage = first_pattern >= VDP_PATTERN_COUNT;
+		} else if (!strcmp(argv[i], "--palette") && i + 1 < argc && !path) {
+			first_palette = (unsigned int)strtoul(argv[++i], NULL, 10);
+			usage = first_palette >= MAX_PALETTES;
+		} else if (!strcmp(argv[i], "--sprite") && path) {
+			is_sprite = true;
+		} else if (argv[i][0] != '-' && !path) {
+			path = argv[i];
+		} else if (argv[i][0] != '-') {
+			success = add_image(argv[i], is_sprite);
+			is_sprite = false;
+		} else {
+			usage = true;
+		}
+	}
+	if (success && (usage || !map_count)) {
+		fprintf(stderr, "usage: %s [--pattern first] [--palette first] pack [--sprite] image.png...\n", argv[0]);
+		success = false;
+	}
+	if (success && (success = write_pack(path))) {
+		printf("%u tiles, %u patterns (%u shared, %u of them flipped), %u palettes, %u of %d patterns left\n",
+			tile_count, pattern_count, tile_count - pattern_count, flipped_count, palette_count,
+			VDP_PATTERN_COUNT - first_pattern - pattern_count, VDP_PATTERN_COUNT);
+	}
+	for (unsigned int i = 0; i < map_count; ++i) {
+		free(maps[i].cells);
+	}
+	free(maps);
+	return success ? 0 : -1;
+}
@@ -0,0 +1,187 @@
+/* Copyright (c) 2019 Pierre-Marc Jobin
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <GL/gl3w.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vdp.h>
+
+#define countof(a) (sizeof (a) / sizeof (a[0]))
+
+enum {
+	WARMUP_FRAMES = 8
+};
+
+// Plays a trace recorded with vdp_start_trace back headless, as fast as possible or at the recorded
+// pace, and reports timings as JSON. With --checksum the last frame is read back and hashed once the
+// timed loop is over, so that the output of two builds can be compared on the same trace.
+
+static const struct {
+	const char *name;
+	vdp_backend_t backend;
+} backends[] = {
+	{ "opengl", VDP_BACKEND_OPENGL },
+	{ "compute", VDP_BACKEND_COMPUTE },
+	{ "software", VDP_BACKEND_SOFTWARE },
+	{ "reference", VDP_BACKEND_REFERENCE },
+};
+
+static uint32_t pixels[VDP_FRAMEBUFFER_WIDTH * VDP_FRAMEBUFFER_HEIGHT];
+
+static double get_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void wait_until(double t) {
+	double remaining = t - get_time();
+	if (remaining > 0.0) {
+		struct timespec ts = { (time_t)remaining, (long)((remaining - (time_t)remaining) * 1e9) };
+		nanosleep(&ts, NULL);
+	}
+}
+
+// FNV-1a over the color channels only, alpha differs between backends.
+static uint64_t hash_pixels(uint64_t hash) {
+	for (unsigned int i = 0; i < countof (pixels); ++i) {
+		for (unsigned int j = 0; j < 3; ++j) {
+			hash = (hash ^ (pixels[i] >> j * 8 & 0xFF)) * 0x100000001B3u;
+		}
+	}
+	return hash;
+}
+
+int main(int argc, char *argv[]) {
+	const char *path = NULL;
+	const char *backend_name = "opengl";
+	bool paced = false;
+	bool checksum = false;
+	unsigned int loops = 1;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--paced")) {
+			paced = true;
+		} else if (!strcmp(argv[i], "--checksum")) {
+			checksum = true;
+		} else if (!strcmp(argv[i], "--backend") && i + 1 < argc) {
+			backend_name = argv[++i];
+		} else if (!strcmp(argv[i], "--loop") && i + 1 < argc) {
+			loops = (unsigned int)strtoul(argv[++i], NULL, 10);
+		} else if (argv[i][0] != '-' && !path) {
+			path = argv[i];
+		} else {
+			path = NULL;
+			break;
+		}
+	}
+	if (!path || !loops) {
+		fprintf(stderr, "usage: %s [--paced] [--checksum] [--loop n] [--backend opengl|compute|software|reference] trace\n", argv[0]);
+		return -1;
+	}
+	unsigned int backend = 0;
+	while (backend < countof (backends) && strcmp(backends[backend].name, backend_name)) {
+		++backend;
+	}
+	if (backend == countof (backends)) {
+		fprintf(stderr, "Unknown backend '%s', exiting.\n", backend_name);
+		return -1;
+	}
+
+	vdp_replay_t *replay = vdp_open_replay(path);
+	if (!replay) {
+		return -1;
+	}
+	vdp_headless_t *headless = vdp_create_headless();
+	if (!headless) {
+		vdp_close_replay(replay);
+		fprintf(stderr, "Unable to create headless GL context, exiting.\n");
+		return -1;
+	}
+	if (!gl3wIsSupported(4, 5)) {
+		vdp_destroy_headless(headless);
+		vdp_close_replay(replay);
+		fprintf(stderr, "OpenGL 4.5 not supported, exiting.\n");
+		return -1;
+	}
+	vdp_context_t *vdp = vdp_create_backend_context(backends[backend].backend);
+	if (!vdp) {
+		vdp_destroy_headless(headless);
+		vdp_close_replay(replay);
+		fprintf(stderr, "Unable to create VDP emulator, exiting.\n");
+		return -1;
+	}
+
+	// GPU times lag behind and the first query of a context is unreliable on some drivers, skip a few
+	unsigned int frames = 0;
+	unsigned int timed_frames = 0;
+	double render_ms = 0.0;
+	uint64_t uploaded_bytes = 0;
+	vdp_stats_t stats;
+	const double start = get_time();
+	for (unsigned int loop = 0; loop < loops; ++loop) {
+		const double loop_start = get_time();
+		uint64_t time;
+		vdp_rewind_replay(replay);
+		while (vdp_replay_frame(replay, vdp, &time)) {
+			vdp_get_stats(vdp, &stats);
+			if (++frames > WARMUP_FRAMES) {
+				render_ms += stats.render_ms;
+				++timed_frames;
+			}
+			for (unsigned int i = 0; i < VDP_TABLE_COUNT; ++i) {
+				uploaded_bytes += stats.uploaded_bytes[i];
+			}
+			if (paced) {
+				wait_until(loop_start + time * 1e-9);
+			}
+		}
+	}
+	glFinish();
+	const double elapsed = get_time() - start;
+	vdp_get_stats(vdp, &stats);
+	uint64_t hash = 0xCBF29CE484222325u;
+	if (checksum) {
+		vdp_read_pixels(vdp, pixels);
+		hash = hash_pixels(hash);
+	}
+
+	printf("{\n");
+	printf("\t\"renderer\": \"%s\",\n", (const char *)glGetString(GL_RENDERER));
+	printf("\t\"backend\": \"%s\",\n", backends[backend].name);
+	printf("\t\"trace\": \"%s\",\n", path);
+	printf("\t\"frames\": %u,\n", frames);
+	printf("\t\"elapsed_s\": %.3f,\n", elapsed);
+	printf("\t\"fps\": %.2f,\n", frames / elapsed);
+	printf("\t\"frame_ms\": { \"min\": %.3f, \"avg\": %.3f, \"p99\": %.3f },\n", stats.frame_ms_min, stats.frame_ms_avg, stats.frame_ms_p99);
+	printf("\t\"render_ms\": %.3f,\n", timed_frames ? render_ms / timed_frames : 0.0);
+	printf("\t\"upload_mb_per_s\": %.3f", uploaded_bytes / elapsed / (1024.0 * 1024.0));
+	if (checksum) {
+		printf(",\n\t\"checksum\": \"%016llx\"", (unsigned long long)hash);
+	}
+	printf("\n}\n");
+
+	vdp_destroy_context(vdp);
+	vdp_destroy_headless(headless);
+	vdp_close_replay(replay);
+	return 0;
+}